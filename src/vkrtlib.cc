@@ -13,8 +13,16 @@
 //    Marcio Machado Pereira
 
 #include "vkrtlib.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <functional>
+#include <iomanip>
+#include <set>
 #include <vector>
 
 namespace vkrtl {
@@ -22,6 +30,26 @@ namespace vkrtl {
 uint32_t _verbose;
 uint32_t _profile;
 
+// version of the Vulkan API the instance was created for
+uint32_t _apiVersion = VK_API_VERSION_1_0;
+
+// Records the enclosing scope as a host span in the trace of the profiler,
+// if there is one.
+class TraceSpan {
+  private:
+    Profiler *profiler;
+    const char *name;
+    std::chrono::steady_clock::time_point start;
+
+  public:
+    TraceSpan(Profiler *profiler, const char *name) : profiler(profiler), name(name) {
+        if (profiler) start = std::chrono::steady_clock::now();
+    }
+    ~TraceSpan() {
+        if (profiler) profiler->hostSpan(name, start, std::chrono::steady_clock::now());
+    }
+};
+
 static VKAPI_ATTR VkBool32 VKAPI_CALL debugReportCallbackFn(
         VkDebugReportFlagsEXT flags,
         VkDebugReportObjectTypeEXT objectType,
@@ -46,14 +74,22 @@ void DestroyDebugReportCallbackEXT(VkInstance instance,
 }
 
 
-Object::Object(enum ModeOptions mode) {
+Object::Object(enum ModeOptions mode, std::vector<std::string> requiredExtensions)
+    : requiredExtensions(requiredExtensions) {
 
     _verbose = mode == VKRTL_verbose || mode == VKRTL_all;
     _profile = mode == VKRTL_profile || mode == VKRTL_all;
 
+    // ask for Vulkan 1.1 when the loader has it, for vkCmdDispatchBase
+    auto enumerateInstanceVersion =
+        (PFN_vkEnumerateInstanceVersion)vkGetInstanceProcAddr(nullptr, "vkEnumerateInstanceVersion");
+    uint32_t loaderVersion = VK_API_VERSION_1_0;
+    if (enumerateInstanceVersion) enumerateInstanceVersion(&loaderVersion);
+    _apiVersion = loaderVersion >= VK_API_VERSION_1_1 ? VK_API_VERSION_1_1 : VK_API_VERSION_1_0;
+
     VkApplicationInfo applicationInfo = {};
     applicationInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
-    applicationInfo.apiVersion = VK_API_VERSION_1_0;
+    applicationInfo.apiVersion = _apiVersion;
 
     VkInstanceCreateInfo createInfo = {};
     createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
@@ -155,16 +191,12 @@ Object::Object(enum ModeOptions mode) {
         throw VKRTL_ERROR_DEVICES;
     }
 
-    VkPhysicalDevice *physicalDevices = new VkPhysicalDevice[numDevices];
-    if (VK_SUCCESS != vkEnumeratePhysicalDevices(instance, &numDevices, physicalDevices)) {
+    physicalDevices.resize(numDevices);
+    if (VK_SUCCESS != vkEnumeratePhysicalDevices(instance, &numDevices, physicalDevices.data())) {
         throw VKRTL_ERROR_DEVICES;
     }
 
-    for (uint32_t i = 0; i < numDevices; i++) {
-        devices.push_back(Device(physicalDevices[i]));
-    }
-
-    delete[] physicalDevices;
+    created.resize(numDevices, nullptr);
 }
 
 Object::~Object() {
@@ -172,15 +204,169 @@ Object::~Object() {
         DestroyDebugReportCallbackEXT(instance, debugReportCallback, nullptr);
         std::cout << "[vkrtl] clean up Vulkan Object." << std::endl;
     }
+    for (Device *device : created) delete device;
     vkDestroyInstance(instance, nullptr);
 }
 
 std::vector<Device> &Object::getDevices() {
+    devices.clear();
+    for (size_t i = 0; i < physicalDevices.size(); i++) {
+        devices.push_back(create((int)i));
+    }
     return devices;
 }
 
+Device &Object::create(int index) {
+    if (!created[index]) {
+        created[index] = new Device(physicalDevices[index], requiredExtensions);
+    }
+    return *created[index];
+}
+
+// Subgroup size and UUID of a device, which only Vulkan 1.1 reports;
+// 0 and an empty string otherwise.
+static void getIdentity(VkInstance instance, VkPhysicalDevice physicalDevice, uint32_t &subgroupSize,
+                        std::string &uuid) {
+    subgroupSize = 0;
+    uuid.clear();
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    auto getProperties2 = (PFN_vkGetPhysicalDeviceProperties2KHR)vkGetInstanceProcAddr(
+        instance, "vkGetPhysicalDeviceProperties2");
+    if (_apiVersion < VK_API_VERSION_1_1 || properties.apiVersion < VK_API_VERSION_1_1 || !getProperties2) {
+        return;
+    }
+    VkPhysicalDeviceIDProperties idProperties = {VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES};
+    VkPhysicalDeviceSubgroupProperties subgroupProperties = {VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES};
+    subgroupProperties.pNext = &idProperties;
+    VkPhysicalDeviceProperties2 properties2 = {VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2};
+    properties2.pNext = &subgroupProperties;
+    getProperties2(physicalDevice, &properties2);
+
+    subgroupSize = subgroupProperties.subgroupSize;
+    char hex[3];
+    for (uint32_t i = 0; i < VK_UUID_SIZE; i++) {
+        snprintf(hex, sizeof(hex), "%02x", idProperties.deviceUUID[i]);
+        uuid += hex;
+    }
+}
+
+// Score of a physical device for compute, negative if it cannot be used.
+// The device type dominates; the memory, queues and subgroup size only
+// rank the devices of the same type.
+double Object::score(VkPhysicalDevice physicalDevice) {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+    // the compute queues of the family the Device would use
+    uint32_t familyCount;
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familyCount, nullptr);
+    std::vector<VkQueueFamilyProperties> families(familyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familyCount, families.data());
+    uint32_t computeQueues = 0;
+    for (const auto &family : families) {
+        if (family.queueFlags & VK_QUEUE_COMPUTE_BIT) {
+            computeQueues = family.queueCount;
+            break;
+        }
+    }
+    if (computeQueues == 0) return -1;
+
+    uint32_t extensionCount;
+    vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &extensionCount, nullptr);
+    std::vector<VkExtensionProperties> extensions(extensionCount);
+    vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &extensionCount, extensions.data());
+    for (const auto &required : requiredExtensions) {
+        bool supported = false;
+        for (const auto &extension : extensions) {
+            if (required == extension.extensionName) supported = true;
+        }
+        if (!supported) return -1;
+    }
+
+    double typeRank = 0;
+    switch (properties.deviceType) {
+    case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: typeRank = 4; break;
+    case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: typeRank = 3; break;
+    case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: typeRank = 2; break;
+    case VK_PHYSICAL_DEVICE_TYPE_CPU: typeRank = 1; break;
+    default: break;
+    }
+
+    // largest device-local heap, in GiB
+    VkPhysicalDeviceMemoryProperties memoryProperties;
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+    double localHeap = 0;
+    for (uint32_t i = 0; i < memoryProperties.memoryHeapCount; i++) {
+        if (memoryProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) {
+            localHeap = std::max(localHeap, memoryProperties.memoryHeaps[i].size / (1024.0 * 1024.0 * 1024.0));
+        }
+    }
+
+    uint32_t subgroupSize;
+    std::string uuid;
+    getIdentity(instance, physicalDevice, subgroupSize, uuid);
+
+    return typeRank * 1e6 + std::min(localHeap, 9999.0) * 100 + computeQueues * 10 + subgroupSize / 8.0;
+}
+
+// index of the device named, or identified by its UUID or index, by key; -1 if none
+int Object::find(const char *key) {
+    std::string id;
+    for (const char *c = key; *c; c++) {
+        if (*c != '-') id += (char)tolower(*c);
+    }
+    bool isIndex = !id.empty() && std::all_of(id.begin(), id.end(), ::isdigit);
+    if (isIndex) {
+        // strtoul saturates to ULONG_MAX on overflow, out of range too
+        unsigned long index = strtoul(id.c_str(), nullptr, 10);
+        if (index < physicalDevices.size()) return (int)index;
+    }
+
+    for (size_t i = 0; i < physicalDevices.size(); i++) {
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physicalDevices[i], &properties);
+        uint32_t subgroupSize;
+        std::string uuid;
+        getIdentity(instance, physicalDevices[i], subgroupSize, uuid);
+        if (strstr(properties.deviceName, key) || (!uuid.empty() && uuid == id)) return i;
+    }
+    return -1;
+}
+
 Device &Object::getDevice() {
-    return devices[0];
+    if (selected != -1) return create(selected);
+
+    const char *key = getenv("VKRTL_DEVICE");
+    if (key && *key) {
+        selected = find(key);
+        if (selected == -1) throw VKRTL_ERROR_DEVICES;
+    } else {
+        double best = -1;
+        for (size_t i = 0; i < physicalDevices.size(); i++) {
+            double deviceScore = score(physicalDevices[i]);
+            if (_verbose) {
+                VkPhysicalDeviceProperties properties;
+                vkGetPhysicalDeviceProperties(physicalDevices[i], &properties);
+                std::cout << "[vkrtl] device " << i << ": " << properties.deviceName << ", score " << deviceScore
+                          << std::endl;
+            }
+            if (deviceScore > best) {
+                best = deviceScore;
+                selected = i;
+            }
+        }
+        if (selected == -1) throw VKRTL_ERROR_DEVICES;
+    }
+    Device &device = create(selected);
+    if (_verbose) std::cout << "[vkrtl] selected device: " << device.getName() << std::endl;
+    return device;
+}
+
+Device &Object::getDevice(const char *key) {
+    int index = find(key);
+    if (index == -1) throw VKRTL_ERROR_DEVICES;
+    return create(index);
 }
 
 VkInstance &Object::getInstance() {
@@ -188,7 +374,8 @@ VkInstance &Object::getInstance() {
 }
 
 
-Device::Device(VkPhysicalDevice physicalDevice) : physicalDevice(physicalDevice) {
+Device::Device(VkPhysicalDevice physicalDevice, const std::vector<std::string> &requiredExtensions)
+    : physicalDevice(physicalDevice), context(std::make_shared<Context>()) {
 
     // select a queue family with compute support
     uint32_t numQueues;
@@ -205,28 +392,103 @@ Device::Device(VkPhysicalDevice physicalDevice) : physicalDevice(physicalDevice)
         }
     }
 
-    delete[] queueFamilyProperties;
     if (computeQueueFamily == -1) {
+        delete[] queueFamilyProperties;
         throw VKRTL_ERROR_COMPUTE_QUEUE;
     }
 
-    VkDeviceQueueCreateInfo queueCreateInfo = {VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO};
-    queueCreateInfo.queueCount = 1;
-    float priorities[] = {1.0f};
-    queueCreateInfo.pQueuePriorities = priorities;
-    queueCreateInfo.queueFamilyIndex = computeQueueFamily;
+    // look for a family dedicated to transfers, usually backed by DMA engines
+    for (uint32_t i = 0; i < numQueues; i++) {
+        VkQueueFlags flags = queueFamilyProperties[i].queueFlags;
+        if (flags & VK_QUEUE_TRANSFER_BIT && !(flags & (VK_QUEUE_COMPUTE_BIT | VK_QUEUE_GRAPHICS_BIT))) {
+            transferQueueFamily = i;
+            break;
+        }
+    }
+
+    // create every queue of the family, so that independent
+    // submissions can execute concurrently
+    uint32_t queueCount = queueFamilyProperties[computeQueueFamily].queueCount;
+    uint32_t timestampValidBits = queueFamilyProperties[computeQueueFamily].timestampValidBits;
+    delete[] queueFamilyProperties;
+
+    VkDeviceQueueCreateInfo queueCreateInfos[2] = {{VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO},
+                                                    {VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO}};
+    queueCreateInfos[0].queueCount = queueCount;
+    std::vector<float> priorities(queueCount, 1.0f);
+    queueCreateInfos[0].pQueuePriorities = priorities.data();
+    queueCreateInfos[0].queueFamilyIndex = computeQueueFamily;
+    queueCreateInfos[1].queueCount = 1;
+    queueCreateInfos[1].pQueuePriorities = priorities.data();
+    queueCreateInfos[1].queueFamilyIndex = transferQueueFamily;
+
+    // Timeline semaphores let us track the completion of each submission
+    // with a single counter instead of a fence per submission.
+    // VK_KHR_timeline_semaphore needs the physical device properties 2 of
+    // Vulkan 1.1: a 1.0 instance tracks submissions with fences.
+    uint32_t extensionCount;
+    vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &extensionCount, nullptr);
+    std::vector<VkExtensionProperties> extensions(extensionCount);
+    vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &extensionCount, extensions.data());
+    bool timelineSemaphore = false;
+    for (const auto &extension : extensions) {
+        if (strcmp(extension.extensionName, VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME) == 0 &&
+            _apiVersion >= VK_API_VERSION_1_1) {
+            timelineSemaphore = true;
+        }
+    }
+    std::vector<const char *> enabledExtensions;
+    VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timelineSemaphoreFeatures = {
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR};
+    timelineSemaphoreFeatures.timelineSemaphore = VK_TRUE;
 
     // create the logical device
     VkPhysicalDeviceFeatures physicalDeviceFeatures = {};
     VkDeviceCreateInfo deviceCreateInfo = {VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO};
-    deviceCreateInfo.pQueueCreateInfos = &queueCreateInfo;
+    deviceCreateInfo.pQueueCreateInfos = queueCreateInfos;
     deviceCreateInfo.pEnabledFeatures = &physicalDeviceFeatures;
     deviceCreateInfo.queueCreateInfoCount = 1;
-    if (VK_SUCCESS != vkCreateDevice(physicalDevice, &deviceCreateInfo, nullptr, &device)) {
+    if (timelineSemaphore) {
+        enabledExtensions.push_back(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME);
+        deviceCreateInfo.pNext = &timelineSemaphoreFeatures;
+    } else {
+        // without timeline semaphores the staging copies stay on the compute queues
+        transferQueueFamily = -1;
+    }
+    // VK_KHR_push_descriptor needs the physical device properties 2 of Vulkan 1.1
+    bool pushDescriptor = false;
+    for (const auto &extension : extensions) {
+        if (strcmp(extension.extensionName, VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME) == 0 &&
+            _apiVersion >= VK_API_VERSION_1_1) {
+            pushDescriptor = true;
+            enabledExtensions.push_back(VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME);
+        }
+    }
+    for (const auto &required : requiredExtensions) {
+        for (const auto &extension : extensions) {
+            if (required == extension.extensionName && required != VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME &&
+                required != VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME) {
+                enabledExtensions.push_back(required.c_str());
+            }
+        }
+    }
+    if (transferQueueFamily != -1) {
+        deviceCreateInfo.queueCreateInfoCount = 2;
+    }
+    deviceCreateInfo.enabledExtensionCount = enabledExtensions.size();
+    deviceCreateInfo.ppEnabledExtensionNames = enabledExtensions.data();
+    if (VK_SUCCESS != vkCreateDevice(physicalDevice, &deviceCreateInfo, nullptr, &context->device)) {
         throw VKRTL_ERROR_DEVICES;
     }
 
-    vkGetDeviceQueue(device, computeQueueFamily, 0, &queue);
+    queues = new QueueScheduler(context->device, computeQueueFamily, queueCount, timelineSemaphore);
+    if (_verbose)
+        std::cout << "[vkrtl] using " << queueCount << " compute queue(s)" << std::endl;
+    if (transferQueueFamily != -1) {
+        transferQueue = new Queue(context->device, transferQueueFamily, 0, timelineSemaphore);
+        if (_verbose)
+            std::cout << "[vkrtl] using a transfer queue (family " << transferQueueFamily << ")" << std::endl;
+    }
 
     // With VkPhysicalDeviceProperties() we obtain a list of physical device limitations.
     // This library launches a compute shader, and the maximum size of the workgroups and
@@ -236,30 +498,73 @@ Device::Device(VkPhysicalDevice physicalDevice) : physicalDevice(physicalDevice)
     // Moreover, we are using a storage buffer in the compute shader, and we should ensure that
     // it is not larger than the device can handle, by checking the limitation maxStorageBufferRange.
 
-    vkGetPhysicalDeviceProperties(physicalDevice, &physicalDeviceProperties);
+    vkGetPhysicalDeviceProperties(physicalDevice, &context->physicalDeviceProperties);
+
+    // dispatches with a base group, to split grids too large for one dispatch
+    if (_apiVersion >= VK_API_VERSION_1_1 && context->physicalDeviceProperties.apiVersion >= VK_API_VERSION_1_1) {
+        context->vkCmdDispatchBase =
+            (PFN_vkCmdDispatchBaseKHR)vkGetDeviceProcAddr(context->device, "vkCmdDispatchBase");
+        context->vkCreateDescriptorUpdateTemplate = (PFN_vkCreateDescriptorUpdateTemplateKHR)vkGetDeviceProcAddr(
+            context->device, "vkCreateDescriptorUpdateTemplate");
+        context->vkDestroyDescriptorUpdateTemplate = (PFN_vkDestroyDescriptorUpdateTemplateKHR)vkGetDeviceProcAddr(
+            context->device, "vkDestroyDescriptorUpdateTemplate");
+        context->vkUpdateDescriptorSetWithTemplate = (PFN_vkUpdateDescriptorSetWithTemplateKHR)vkGetDeviceProcAddr(
+            context->device, "vkUpdateDescriptorSetWithTemplate");
+    }
+
+    // descriptors recorded in the command buffers, without descriptor sets
+    if (pushDescriptor) {
+        context->vkCmdPushDescriptorSet =
+            (PFN_vkCmdPushDescriptorSetKHR)vkGetDeviceProcAddr(context->device, "vkCmdPushDescriptorSetKHR");
+    }
 
     // get indices of memory types we care about
-    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &physicalDeviceMemoryProperties);
-    for (uint32_t i = 0; i < physicalDeviceMemoryProperties.memoryTypeCount; i++) {
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &context->physicalDeviceMemoryProperties);
+    VkPhysicalDeviceMemoryProperties &memoryProperties = context->physicalDeviceMemoryProperties;
+    for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++) {
 
         // VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT bit specifies that memory allocated
         // with this type can be mapped for host access using vkMapMemory.
-        if (physicalDeviceMemoryProperties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT &&
-            memoryTypeMappable == -1) {
-            memoryTypeMappable = i;
+        if (memoryProperties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT &&
+            context->memoryTypeMappable == -1) {
+            context->memoryTypeMappable = i;
         }
         // VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT bit specifies that memory allocated
         // with this type is the most efficient for device access.
-        if (physicalDeviceMemoryProperties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT &&
-            memoryTypeLocal == -1) {
-            memoryTypeLocal = i;
+        if (memoryProperties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT &&
+            context->memoryTypeLocal == -1) {
+            context->memoryTypeLocal = i;
         }
     }
 
     if (_verbose) showProperties();
 
-    // create the implicit command buffer
-    implicitCommandBuffer = new CommandBuffer(*this);
+    loadPipelineCache();
+
+    // the queues of the compute family must support timestamps to profile
+    if (_profile) {
+        if (timestampValidBits == 0) {
+            std::cout << "[vkrtl] timestamps are not supported, profiling disabled" << std::endl;
+        } else {
+            context->profiler = new Profiler(context->device,
+                                             context->physicalDeviceProperties.limits.timestampPeriod,
+                                             timestampValidBits);
+        }
+    }
+
+    // buffers are sub-allocated from large blocks of device memory
+    context->allocator = new MemoryAllocator(context->device, context->physicalDeviceProperties,
+                                             context->physicalDeviceMemoryProperties);
+
+    // command buffers are allocated from per-thread pools
+    commandPools = new CommandPools(context->device);
+
+    // descriptor sets are allocated from pools shared by all the Arguments
+    context->descriptors = new DescriptorAllocator(context->device);
+    context->descriptorCache = new DescriptorCache(context->descriptors);
+
+    // create the staging ring used by Buffer::offload and Buffer::inload
+    context->stagingRing = new StagingRing(*this);
 }
 
 void Device::showProperties() {
@@ -274,9 +579,9 @@ void Device::showProperties() {
          physicalDeviceExtensions.data());
 
     // print info
-    std::cout << "[vkrtl] selected device name: " << physicalDeviceProperties.deviceName
+    std::cout << "[vkrtl] selected device name: " << context->physicalDeviceProperties.deviceName
         << std::endl << "[vkrtl] selected device type: ";
-    switch (physicalDeviceProperties.deviceType)
+    switch (context->physicalDeviceProperties.deviceType)
     {
     case VK_PHYSICAL_DEVICE_TYPE_OTHER:
         std::cout << "VK_PHYSICAL_DEVICE_TYPE_OTHER";
@@ -296,15 +601,15 @@ void Device::showProperties() {
     default:
         ;
     }
-    std::cout << " (" << physicalDeviceProperties.deviceType << ")" << std::endl
+    std::cout << " (" << context->physicalDeviceProperties.deviceType << ")" << std::endl
         << "[vkrtl] selected device driver version: "
-        << VK_VERSION_MAJOR(physicalDeviceProperties.driverVersion) << "."
-        << VK_VERSION_MINOR(physicalDeviceProperties.driverVersion) << "."
-        << VK_VERSION_PATCH(physicalDeviceProperties.driverVersion) << std::endl
+        << VK_VERSION_MAJOR(context->physicalDeviceProperties.driverVersion) << "."
+        << VK_VERSION_MINOR(context->physicalDeviceProperties.driverVersion) << "."
+        << VK_VERSION_PATCH(context->physicalDeviceProperties.driverVersion) << std::endl
         << "[vkrtl] selected device vulkan api version: "
-        << VK_VERSION_MAJOR(physicalDeviceProperties.apiVersion) << "."
-        << VK_VERSION_MINOR(physicalDeviceProperties.apiVersion) << "."
-        << VK_VERSION_PATCH(physicalDeviceProperties.apiVersion) << std::endl;
+        << VK_VERSION_MAJOR(context->physicalDeviceProperties.apiVersion) << "."
+        << VK_VERSION_MINOR(context->physicalDeviceProperties.apiVersion) << "."
+        << VK_VERSION_PATCH(context->physicalDeviceProperties.apiVersion) << std::endl;
     std::cout << "[vkrtl] selected device available extensions:" << std::endl;
     for (const auto& extension : physicalDeviceExtensions)
     {
@@ -316,372 +621,3073 @@ void Device::showProperties() {
 }
 
 void Device::destroy() {
-    implicitCommandBuffer->destroy();
-    delete implicitCommandBuffer;
-    vkDestroyDevice(device, nullptr);
+    // nothing may be in flight when the pools of its command buffers
+    // and descriptor sets are destroyed
+    wait();
+    context->destroyed = true;
+    if (context->profiler) {
+        context->profiler->summary();
+        context->profiler->destroy();
+        delete context->profiler;
+    }
+    context->stagingRing->destroy();
+    delete context->stagingRing;
+    commandPools->destroy();
+    delete commandPools;
+    context->descriptorCache->destroy();
+    delete context->descriptorCache;
+    context->descriptors->destroy();
+    delete context->descriptors;
+    queues->destroy();
+    delete queues;
+    if (transferQueue) {
+        transferQueue->destroy();
+        delete transferQueue;
+    }
+    if (_verbose) {
+        MemoryStats stats = context->allocator->getStats();
+        std::cout << "[vkrtl] memory blocks: " << stats.blockCount << " (" << stats.blockBytes
+                  << " bytes), buffers still allocated: " << stats.allocationCount << std::endl;
+    }
+    context->allocator->destroy();
+    delete context->allocator;
+    savePipelineCache();
+    vkDestroyPipelineCache(context->device, context->pipelineCache, nullptr);
+    vkDestroyDevice(context->device, nullptr);
     if (_verbose)
         std::cout << "[vkrtl] clean up Vulkan Device." << std::endl;
 }
 
-void Device::submit(VkCommandBuffer commandBuffer) {
-    VkSubmitInfo submitInfo = {VK_STRUCTURE_TYPE_SUBMIT_INFO};
-    submitInfo.commandBufferCount = 1;
-    VkCommandBuffer commandBuffers[1] = {commandBuffer};
-    submitInfo.pCommandBuffers = commandBuffers;
-    if (VK_SUCCESS != vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE)) {
-        throw VKRTL_ERROR_SUBMIT_QUEUE;
-    }
+// The pipeline cache of each device lives in its own file, in the directory
+// given by VKRTL_PIPELINE_CACHE_DIR or else in the working directory.
+std::string Device::getPipelineCachePath() {
+    const char *directory = getenv("VKRTL_PIPELINE_CACHE_DIR");
+    std::string path = directory ? std::string(directory) + "/" : "";
+    char name[64];
+    snprintf(name, sizeof(name), "vkrtl-%04x-%04x.cache", context->physicalDeviceProperties.vendorID,
+             context->physicalDeviceProperties.deviceID);
+    return path + name;
 }
 
-void Device::wait() {
-    if (VK_SUCCESS != vkQueueWaitIdle(queue)) {
-        throw VKRTL_ERROR_SUBMIT_QUEUE;
+void Device::loadPipelineCache() {
+    std::vector<char> data;
+    std::string path = getPipelineCachePath();
+    std::ifstream fin(path, std::ifstream::binary | std::ifstream::ate);
+    if (fin) {
+        data.resize((size_t)fin.tellg());
+        fin.seekg(0, std::ifstream::beg);
+        fin.read(data.data(), data.size());
+        if (!fin) data.clear();
     }
-}
 
-const char *Device::getName() {
-    return physicalDeviceProperties.deviceName;
+    // A cache written by another device or driver version is dropped: its
+    // header must match our vendor, device and pipeline cache UUID.
+    struct {
+        uint32_t headerLength;
+        uint32_t headerVersion;
+        uint32_t vendorID;
+        uint32_t deviceID;
+        uint8_t uuid[VK_UUID_SIZE];
+    } header;
+    if (data.size() >= sizeof(header)) {
+        memcpy(&header, data.data(), sizeof(header));
+        if (header.headerLength < sizeof(header) || header.headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE ||
+            header.vendorID != context->physicalDeviceProperties.vendorID ||
+            header.deviceID != context->physicalDeviceProperties.deviceID ||
+            memcmp(header.uuid, context->physicalDeviceProperties.pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+            if (_verbose) std::cout << "[vkrtl] discard stale pipeline cache " << path << std::endl;
+            data.clear();
+        }
+    } else {
+        data.clear();
+    }
+
+    VkPipelineCacheCreateInfo pipelineCacheCreateInfo = {VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO};
+    pipelineCacheCreateInfo.initialDataSize = data.size();
+    pipelineCacheCreateInfo.pInitialData = data.empty() ? nullptr : data.data();
+    if (VK_SUCCESS !=
+        vkCreatePipelineCache(context->device, &pipelineCacheCreateInfo, nullptr, &context->pipelineCache)) {
+        // the driver may still reject the data, start with an empty cache then
+        pipelineCacheCreateInfo.initialDataSize = 0;
+        pipelineCacheCreateInfo.pInitialData = nullptr;
+        if (VK_SUCCESS !=
+            vkCreatePipelineCache(context->device, &pipelineCacheCreateInfo, nullptr, &context->pipelineCache)) {
+            throw VKRTL_ERROR_PIPELINE;
+        }
+    }
+    if (_verbose && !data.empty())
+        std::cout << "[vkrtl] load pipeline cache " << path << " (" << data.size() << " bytes)" << std::endl;
 }
 
-uint32_t Device::getVendorId() {
-    return physicalDeviceProperties.vendorID;
+// Write to a temporary file first and rename it, so that processes
+// starting concurrently never read a partially written cache.
+void Device::savePipelineCache() {
+    size_t size;
+    if (VK_SUCCESS != vkGetPipelineCacheData(context->device, context->pipelineCache, &size, nullptr) || size == 0) {
+        return;
+    }
+    std::vector<char> data(size);
+    if (VK_SUCCESS != vkGetPipelineCacheData(context->device, context->pipelineCache, &size, data.data())) return;
+
+    std::string path = getPipelineCachePath();
+    std::string temporary = path + ".tmp";
+    std::ofstream fout(temporary, std::ofstream::binary | std::ofstream::trunc);
+    fout.write(data.data(), size);
+    fout.close();
+    if (!fout || std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::remove(temporary.c_str());
+        if (_verbose) std::cout << "[vkrtl] could not write pipeline cache " << path << std::endl;
+        return;
+    }
+    if (_verbose) std::cout << "[vkrtl] save pipeline cache " << path << " (" << size << " bytes)" << std::endl;
 }
 
+Event Device::submit(VkCommandBuffer commandBuffer) {
+    TraceSpan span(context->profiler, "Device::submit");
+    Queue *queue = queues->select();
+    Event event(queue, queue->submit(commandBuffer));
+    if (context->profiler) context->profiler->submitted(commandBuffer, event.queue, event.serial);
+    return event;
+}
 
-void CommandBuffer::sharedConstructor() {
-    // Command pools are used mainly as a source of memory for the command buffers
-    // When we use VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT, we can reset
-    // command buffers individually. Command pools also control the queues to which
-    // command buffers can be submitted. This is achieved through a queue family index
-    VkCommandPoolCreateInfo commandPoolCreateInfo = {VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO};
-    commandPoolCreateInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-    commandPoolCreateInfo.queueFamilyIndex = this->computeQueueFamily;
-    if (VK_SUCCESS != vkCreateCommandPool(this->device, &commandPoolCreateInfo, nullptr, &commandPool)) {
-        throw VKRTL_ERROR_COMMAND_POOL;
+Event Device::submit(VkCommandBuffer commandBuffer, Event &after) {
+    TraceSpan span(context->profiler, "Device::submit");
+    Queue *queue = queues->select();
+    Event event;
+    if (after.queue == nullptr || after.queue == queue) {
+        // the transfer and the kernel share the queue, so submission order
+        // and the barrier of the transfer already chain them
+        event = Event(queue, queue->submit(commandBuffer));
+    } else if (after.queue->getSemaphore() == VK_NULL_HANDLE) {
+        // without timeline semaphores, follow the transfer on its queue
+        event = Event(after.queue, after.queue->submit(commandBuffer));
+    } else {
+        SemaphoreOperation wait = {after.queue->getSemaphore(), after.serial, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT};
+        event = Event(queue, queue->submit(commandBuffer, 1, &wait));
     }
+    if (context->profiler) context->profiler->submitted(commandBuffer, event.queue, event.serial);
+    return event;
+}
 
-    // Command buffers are allocated from command pools and can be submitted
-    // only to queues from the specified family.
-    VkCommandBufferAllocateInfo commandBufferAllocateInfo = {VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO};
-    commandBufferAllocateInfo.commandBufferCount = 1;
-    // Primary command buffers can be directly submitted to queues.
-    commandBufferAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    commandBufferAllocateInfo.commandPool = commandPool;
-    if (VK_SUCCESS != vkAllocateCommandBuffers(this->device, &commandBufferAllocateInfo, &commandBuffer)) {
-        throw VKRTL_ERROR_COMMAND_BUFFER;
-    }
+// The downloads reach their host arrays when their slices are retired,
+// so the ring is drained once the queues are idle.
+void Device::wait() {
+    TraceSpan span(context->profiler, "Device::wait");
+    queues->wait();
+    if (transferQueue) transferQueue->wait();
+    if (context->stagingRing) context->stagingRing->wait();
 }
 
-CommandBuffer::CommandBuffer(Device &device) : Device(device) {
-    sharedConstructor();
+void Device::nextEpoch() {
+    context->descriptors->nextEpoch();
 }
 
-CommandBuffer::CommandBuffer(Device &device, Kernel &kernel, Arguments &arguments) : Device(device) {
-    sharedConstructor();
-    begin();
-    arguments.bindTo(*this);
-    kernel.bindTo(*this);
+void Device::wait(Event &event) {
+    TraceSpan span(context->profiler, "Device::wait");
+    event.wait();
 }
 
-void CommandBuffer::destroy() {
-    vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
-    vkDestroyCommandPool(device, commandPool, nullptr);
+const char *Device::getName() {
+    return context->physicalDeviceProperties.deviceName;
 }
 
-CommandBuffer::operator VkCommandBuffer() {
-    return commandBuffer;
+uint32_t Device::getVendorId() {
+    return context->physicalDeviceProperties.vendorID;
 }
 
-void CommandBuffer::begin() {
-    VkCommandBufferBeginInfo commandBufferBeginInfo = {VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
-    if (VK_SUCCESS != vkBeginCommandBuffer(commandBuffer, &commandBufferBeginInfo)) {
-        throw VKRTL_ERROR_COMMAND_BUFFER;
-    }
+MemoryStats Device::getMemoryStats() {
+    return context->allocator->getStats();
 }
 
-void CommandBuffer::barrier() {
-    vkCmdPipelineBarrier(commandBuffer,
-            VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-            VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0,
-            nullptr, 0, nullptr, 0, nullptr);
+std::map<std::string, KernelProfile> Device::getKernelProfiles() {
+    if (context->profiler == nullptr) return std::map<std::string, KernelProfile>();
+    return context->profiler->getProfiles();
 }
 
-void CommandBuffer::dispatch(int x, int y, int z) {
-    vkCmdDispatch(commandBuffer, x, y, z);
+bool Device::exportTrace(const char *fileName) {
+    if (context->profiler == nullptr) return false;
+    return context->profiler->exportTrace(fileName);
 }
 
-void CommandBuffer::end() {
-    if (VK_SUCCESS != vkEndCommandBuffer(commandBuffer)) {
-        throw VKRTL_ERROR_COMMAND_BUFFER;
-    }
+const std::shared_ptr<Device::Context> &Device::getContext() {
+    return context;
 }
 
-Buffer::Buffer(Device &device, size_t byteSize, bool mappable) : Device(device) {
-    // create buffer
-    VkBufferCreateInfo bufferCreateInfo = {VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
-    bufferCreateInfo.size = byteSize;
-    // specifies that the buffer can be used in a VkDescriptorBufferInfo suitable
-    // for occupying a VkDescriptorSet slot either of type
-    // VK_DESCRIPTOR_TYPE_STORAGE_BUFFER or VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC
-    bufferCreateInfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
-    // specifies that the buffer can be used as the source of a transfer command
-    bufferCreateInfo.usage |= VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-    // specifies that the buffer can be used as the destination of a transfer command
-    bufferCreateInfo.usage |= VK_BUFFER_USAGE_TRANSFER_DST_BIT;
-    if (VK_SUCCESS != vkCreateBuffer(this->device, &bufferCreateInfo, nullptr, &buffer)) {
-        throw VKRTL_ERROR_CREATE_BUFFER;
-    }
 
-    // get memory requirements
-    VkMemoryRequirements memoryRequirements;
-    vkGetBufferMemoryRequirements(this->device, buffer, &memoryRequirements);
+Queue::Queue(VkDevice device, uint32_t family, uint32_t index, bool timelineSemaphore)
+    : device(device), family(family) {
+    vkGetDeviceQueue(device, family, index, &queue);
 
-    // allocate memory for the buffer
-    VkMemoryAllocateInfo memoryAllocateInfo = {VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO};
-    memoryAllocateInfo.allocationSize = memoryRequirements.size;
-    memoryAllocateInfo.memoryTypeIndex = mappable ? memoryTypeMappable : memoryTypeLocal;
-    if (VK_SUCCESS != vkAllocateMemory(this->device, &memoryAllocateInfo, nullptr, &memory)) {
-        throw VKRTL_ERROR_MALLOC;
+    if (timelineSemaphore) {
+        VkSemaphoreTypeCreateInfoKHR semaphoreTypeCreateInfo = {VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR};
+        semaphoreTypeCreateInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR;
+        semaphoreTypeCreateInfo.initialValue = 0;
+        VkSemaphoreCreateInfo semaphoreCreateInfo = {VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO};
+        semaphoreCreateInfo.pNext = &semaphoreTypeCreateInfo;
+        if (VK_SUCCESS != vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &semaphore)) {
+            throw VKRTL_ERROR_SUBMIT_QUEUE;
+        }
+        // We have to explicitly load the functions of the extension.
+        vkWaitSemaphoresKHR = (PFN_vkWaitSemaphoresKHR)vkGetDeviceProcAddr(device, "vkWaitSemaphoresKHR");
+        vkGetSemaphoreCounterValueKHR =
+            (PFN_vkGetSemaphoreCounterValueKHR)vkGetDeviceProcAddr(device, "vkGetSemaphoreCounterValueKHR");
     }
+}
 
-    // bind memory to the buffer
-    if (VK_SUCCESS != vkBindBufferMemory(this->device, buffer, memory, 0)) {
-        throw VKRTL_ERROR_MALLOC;
+uint64_t Queue::submit(VkCommandBuffer commandBuffer, uint32_t waitCount, const SemaphoreOperation *waits,
+                       uint32_t signalCount, const SemaphoreOperation *signals) {
+    const uint32_t maxOperations = 4;
+    if (waitCount > maxOperations || signalCount > maxOperations) {
+        throw VKRTL_ERROR_SUBMIT_QUEUE;
+    }
+    VkSemaphore waitSemaphores[maxOperations];
+    uint64_t waitValues[maxOperations];
+    VkPipelineStageFlags waitStages[maxOperations];
+    for (uint32_t i = 0; i < waitCount; i++) {
+        waitSemaphores[i] = waits[i].semaphore;
+        waitValues[i] = waits[i].value;
+        waitStages[i] = waits[i].stageMask;
+    }
+    // one more slot for the timeline semaphore of the queue
+    VkSemaphore signalSemaphores[maxOperations + 1];
+    uint64_t signalValues[maxOperations + 1];
+    for (uint32_t i = 0; i < signalCount; i++) {
+        signalSemaphores[i] = signals[i].semaphore;
+        signalValues[i] = signals[i].value;
     }
 
-    if (_verbose) {
-        std::string info = "";
-        if (mappable) info = "mappable ";
-        std::cout << "[vrtl] Create a "<< info << "buffer of " <<
-            byteSize << " bytes" << std::endl;
+    VkSubmitInfo submitInfo = {VK_STRUCTURE_TYPE_SUBMIT_INFO};
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &commandBuffer;
+    submitInfo.waitSemaphoreCount = waitCount;
+    submitInfo.pWaitSemaphores = waitSemaphores;
+    submitInfo.pWaitDstStageMask = waitStages;
+    submitInfo.signalSemaphoreCount = signalCount;
+    submitInfo.pSignalSemaphores = signalSemaphores;
+
+    // the queue must be externally synchronized
+    std::lock_guard<std::mutex> lock(mutex);
+    uint64_t serial = submitted + 1;
+    VkFence fence = VK_NULL_HANDLE;
+    VkTimelineSemaphoreSubmitInfoKHR timelineSubmitInfo = {VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR};
+    if (semaphore != VK_NULL_HANDLE) {
+        // values of binary semaphores are ignored
+        signalSemaphores[signalCount] = semaphore;
+        signalValues[signalCount] = serial;
+        submitInfo.signalSemaphoreCount = signalCount + 1;
+        timelineSubmitInfo.waitSemaphoreValueCount = waitCount;
+        timelineSubmitInfo.pWaitSemaphoreValues = waitValues;
+        timelineSubmitInfo.signalSemaphoreValueCount = signalCount + 1;
+        timelineSubmitInfo.pSignalSemaphoreValues = signalValues;
+        submitInfo.pNext = &timelineSubmitInfo;
+    } else {
+        update();
+        if (!freeFences.empty()) {
+            fence = freeFences.back();
+            freeFences.pop_back();
+            vkResetFences(device, 1, &fence);
+        } else {
+            VkFenceCreateInfo fenceCreateInfo = {VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
+            if (VK_SUCCESS != vkCreateFence(device, &fenceCreateInfo, nullptr, &fence)) {
+                throw VKRTL_ERROR_SUBMIT_QUEUE;
+            }
+        }
     }
-}
 
-void Buffer::enqueueCopy(Buffer src, Buffer dst, size_t byteSize, VkCommandBuffer commandBuffer) {
-    VkBufferCopy bufferCopy = {0, 0, byteSize};
-    vkCmdCopyBuffer(commandBuffer, src.buffer, dst.buffer, 1, &bufferCopy);
+    if (VK_SUCCESS != vkQueueSubmit(queue, 1, &submitInfo, fence)) {
+        if (fence != VK_NULL_HANDLE) freeFences.push_back(fence);
+        throw VKRTL_ERROR_SUBMIT_QUEUE;
+    }
+    submitted = serial;
+    if (fence != VK_NULL_HANDLE) {
+        pending.push_back({serial, fence});
+    }
+    return serial;
 }
 
-void Buffer::inload(void *hostPtr) {
-    VkMemoryRequirements memoryRequirements;
-    vkGetBufferMemoryRequirements(this->device, buffer, &memoryRequirements);
-
-    Buffer mappable(*this, memoryRequirements.size, memoryTypeMappable);
-
-    implicitCommandBuffer->begin();
-    enqueueCopy(*this, mappable, memoryRequirements.size, *implicitCommandBuffer);
-    implicitCommandBuffer->end();
-    submit(*implicitCommandBuffer);
-    wait();
-
-    memcpy(hostPtr, mappable.map(), memoryRequirements.size);
-    mappable.unmap();
-    mappable.destroy();
+// Advance the completed serial over the batches that have finished, and
+// give their fences back to the pool. Called with the mutex held.
+void Queue::update() {
+    if (semaphore != VK_NULL_HANDLE) {
+        uint64_t value;
+        if (VK_SUCCESS == vkGetSemaphoreCounterValueKHR(device, semaphore, &value)) {
+            completed = value;
+        }
+        return;
+    }
+    while (!pending.empty() && vkGetFenceStatus(device, pending.front().fence) == VK_SUCCESS) {
+        completed = pending.front().serial;
+        if (waiters.count(pending.front().fence) == 0) freeFences.push_back(pending.front().fence);
+        pending.pop_front();
+    }
 }
 
-void Buffer::offload(void *hostPtr) {
-    VkMemoryRequirements memoryRequirements;
-    vkGetBufferMemoryRequirements(this->device, buffer, &memoryRequirements);
+bool Queue::isComplete(uint64_t serial) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (serial <= completed) return true;
+    update();
+    if (serial <= completed) return true;
 
-    Buffer mappable(*this, memoryRequirements.size, memoryTypeMappable);
-    memcpy(mappable.map(), hostPtr, memoryRequirements.size);
-    mappable.unmap();
+    // a batch may finish before the ones submitted ahead of it
+    if (semaphore == VK_NULL_HANDLE && !pending.empty() && serial <= submitted) {
+        return vkGetFenceStatus(device, pending[serial - pending.front().serial].fence) == VK_SUCCESS;
+    }
+    return false;
+}
 
-    implicitCommandBuffer->begin();
-    enqueueCopy(mappable, *this, memoryRequirements.size, *implicitCommandBuffer);
-    implicitCommandBuffer->end();
-    submit(*implicitCommandBuffer);
-    wait();
+void Queue::wait(uint64_t serial) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (serial <= completed) return;
+    if (serial > submitted) serial = submitted;
+
+    // The mutex is released while waiting, so that other threads can
+    // keep submitting to the queue and waiting for their own batches.
+    if (semaphore != VK_NULL_HANDLE) {
+        lock.unlock();
+        VkSemaphoreWaitInfoKHR semaphoreWaitInfo = {VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR};
+        semaphoreWaitInfo.semaphoreCount = 1;
+        semaphoreWaitInfo.pSemaphores = &semaphore;
+        semaphoreWaitInfo.pValues = &serial;
+        if (VK_SUCCESS != vkWaitSemaphoresKHR(device, &semaphoreWaitInfo, UINT64_MAX)) {
+            throw VKRTL_ERROR_SUBMIT_QUEUE;
+        }
+        lock.lock();
+    } else {
+        update();
+        if (serial <= completed) return;
+        // the fence is kept out of the pool while we wait on it, so that no
+        // submit() resets it and reuses it for another batch meanwhile
+        VkFence fence = pending[serial - pending.front().serial].fence;
+        waiters[fence]++;
+        lock.unlock();
+        VkResult result = vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX);
+        lock.lock();
+        update();
+        if (--waiters[fence] == 0) {
+            waiters.erase(fence);
+            bool inFlight = false;
+            for (auto &submission : pending) {
+                if (submission.fence == fence) inFlight = true;
+            }
+            if (!inFlight) freeFences.push_back(fence);
+        }
+        if (VK_SUCCESS != result) {
+            throw VKRTL_ERROR_SUBMIT_QUEUE;
+        }
+        return;
+    }
+    update();
+}
 
-    mappable.destroy();
+void Queue::wait() {
+    uint64_t serial;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        serial = submitted;
+    }
+    wait(serial);
 }
 
-Buffer::operator VkBuffer() {
-    return buffer;
+uint32_t Queue::getFamily() {
+    return family;
 }
 
-void Buffer::destroy() {
-    if (_verbose) {
-        // get memory requirements
-        VkMemoryRequirements memoryRequirements;
-        vkGetBufferMemoryRequirements(this->device, buffer, &memoryRequirements);
-        std::cout << "[vkrtl] destroy buffer. Size equals " << memoryRequirements.size << std::endl;
-    }
-    vkFreeMemory(device, memory, nullptr);
-    vkDestroyBuffer(device, buffer, nullptr);
+uint64_t Queue::getLoad() {
+    std::lock_guard<std::mutex> lock(mutex);
+    update();
+    return submitted - completed;
 }
 
-void Buffer::unmap() {
-    vkUnmapMemory(device, memory);
+VkSemaphore Queue::getSemaphore() {
+    return semaphore;
 }
 
-void *Buffer::map() {
-    double *pointer;
-    if (VK_SUCCESS != vkMapMemory(device, memory, 0, VK_WHOLE_SIZE, 0, (void **)&pointer)) {
-        throw VKRTL_ERROR_MAP;
+void Queue::destroy() {
+    vkQueueWaitIdle(queue);
+    update();
+    for (auto &submission : pending) {
+        vkDestroyFence(device, submission.fence, nullptr);
+    }
+    pending.clear();
+    for (auto fence : freeFences) {
+        vkDestroyFence(device, fence, nullptr);
+    }
+    freeFences.clear();
+    if (semaphore != VK_NULL_HANDLE) {
+        vkDestroySemaphore(device, semaphore, nullptr);
     }
-    return pointer;
 }
 
-Program::Program(Device &device, const char *fileName) : Device(device) {
-    std::ifstream fin(fileName, std::ifstream::ate);
-    size_t byteLength = fin.tellg();
-    fin.seekg(0, std::ifstream::beg);
-    char *data = new char[byteLength];
-    fin.read(data, byteLength);
-    fin.close();
 
-    VkShaderModuleCreateInfo shaderModuleCreateInfo = {VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO};
-    shaderModuleCreateInfo.codeSize = byteLength;
-    shaderModuleCreateInfo.pCode = (uint32_t *)data;
-    if (VK_SUCCESS != vkCreateShaderModule(this->device, &shaderModuleCreateInfo, nullptr, &shaderModule)) {
-        throw VKRTL_ERROR_SHADER;
+QueueScheduler::QueueScheduler(VkDevice device, uint32_t family, uint32_t queueCount, bool timelineSemaphore) {
+    for (uint32_t i = 0; i < queueCount; i++) {
+        queues.push_back(new Queue(device, family, i, timelineSemaphore));
     }
-    delete[] data;
 }
 
-Program::Program(Device &device, uint32_t *data) : Device(device) {
-    VkShaderModuleCreateInfo shaderModuleCreateInfo = {VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO};
-    shaderModuleCreateInfo.codeSize = sizeof(data);
-    shaderModuleCreateInfo.pCode = data;
-    if (VK_SUCCESS != vkCreateShaderModule(this->device, &shaderModuleCreateInfo, nullptr, &shaderModule)) {
-        throw VKRTL_ERROR_SHADER;
+Queue *QueueScheduler::select() {
+    std::lock_guard<std::mutex> lock(mutex);
+    Queue *&queue = bindings[std::this_thread::get_id()];
+
+    // moving a thread to another queue is only safe when nothing
+    // it submitted before is still in flight
+    if (queue != nullptr && (queues.size() == 1 || queue->getLoad() > 0)) {
+        return queue;
+    }
+    Queue *leastLoaded = nullptr;
+    uint64_t leastLoad = 0;
+    for (size_t i = 0; i < queues.size(); i++) {
+        Queue *candidate = queues[(next + i) % queues.size()];
+        uint64_t load = candidate->getLoad();
+        if (leastLoaded == nullptr || load < leastLoad) {
+            leastLoaded = candidate;
+            leastLoad = load;
+        }
     }
+    next = (next + 1) % queues.size();
+    queue = leastLoaded;
+    return queue;
 }
 
-void Program::destroy() {
-    vkDestroyShaderModule(device, shaderModule, nullptr);
-    if (_verbose)
-        std::cout << "[vkrtl] destroy the Program." << std::endl;
+std::vector<Queue *> &QueueScheduler::getQueues() {
+    return queues;
 }
 
+void QueueScheduler::wait() {
+    for (auto queue : queues) queue->wait();
+}
 
-Kernel::Kernel(Device &device, Program &program, const char *kernelName,
-       std::vector<ResourceType> resourceTypes) : Program(program) {
-    sharedConstructor(kernelName, resourceTypes);
+void QueueScheduler::destroy() {
+    for (auto queue : queues) {
+        queue->destroy();
+        delete queue;
+    }
+    queues.clear();
+    bindings.clear();
 }
 
-Kernel::Kernel(Device &device, Program &program, const char *kernelName,
-       VkCommandBuffer commandBuffer, std::vector<ResourceType> resourceTypes) : Program(program) {
-    sharedConstructor(kernelName, resourceTypes);
-    bindTo(commandBuffer);
+
+Profiler::Profiler(VkDevice device, float timestampPeriod, uint32_t timestampValidBits)
+    : device(device), timestampPeriod(timestampPeriod) {
+    timestampMask = timestampValidBits >= 64 ? ~0ull : (1ull << timestampValidBits) - 1;
+    origin = std::chrono::steady_clock::now();
 }
 
-void Kernel::sharedConstructor(const char *kernelName, std::vector<ResourceType> resourceTypes) {
+double Profiler::sinceOrigin(std::chrono::steady_clock::time_point time) {
+    return std::chrono::duration<double, std::micro>(time - origin).count();
+}
 
-    VkDescriptorSetLayoutBinding *bindings = new VkDescriptorSetLayoutBinding[resourceTypes.size()];
-    for (uint32_t i = 0; i < resourceTypes.size(); i++) {
-        bindings[i].binding = i;
-        bindings[i].descriptorType = (VkDescriptorType)resourceTypes[i];
-        bindings[i].descriptorCount = 1;
-        bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
-        bindings[i].pImmutableSamplers = nullptr;
-    }
+void Profiler::bind(VkCommandBuffer commandBuffer, const std::string &name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    bound[commandBuffer] = name;
+}
 
-    VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {
-        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO};
-    descriptorSetLayoutCreateInfo.pBindings = bindings;
-    descriptorSetLayoutCreateInfo.bindingCount = resourceTypes.size();
-    if (VK_SUCCESS !=
-        vkCreateDescriptorSetLayout(this->device, &descriptorSetLayoutCreateInfo, nullptr, &descriptorSetLayout)) {
-        throw VKRTL_ERROR_SHADER;
-    }
+std::string Profiler::getBound(VkCommandBuffer commandBuffer) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = bound.find(commandBuffer);
+    return it == bound.end() ? "dispatch" : it->second;
+}
 
-    VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = {VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO};
-    pipelineLayoutCreateInfo.setLayoutCount = 1;
-    pipelineLayoutCreateInfo.pSetLayouts = &descriptorSetLayout;
-    if (VK_SUCCESS != vkCreatePipelineLayout(this->device, &pipelineLayoutCreateInfo, nullptr, &pipelineLayout)) {
-        throw VKRTL_ERROR_SHADER;
+Profiler::Query Profiler::begin(VkCommandBuffer commandBuffer) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (freeQueries.empty()) {
+        VkQueryPoolCreateInfo queryPoolCreateInfo = {VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO};
+        queryPoolCreateInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        queryPoolCreateInfo.queryCount = poolSize;
+        VkQueryPool pool;
+        if (VK_SUCCESS != vkCreateQueryPool(device, &queryPoolCreateInfo, nullptr, &pool)) {
+            throw VKRTL_ERROR_COMMAND_BUFFER;
+        }
+        pools.push_back(pool);
+        for (uint32_t i = poolSize; i > 0; i -= 2) freeQueries.push_back({pool, i - 2});
     }
+    Query query = freeQueries.back();
+    freeQueries.pop_back();
+
+    // the reset is recorded too, so that a replayed command buffer
+    // writes its timestamps again at each submission
+    vkCmdResetQueryPool(commandBuffer, query.pool, query.index, 2);
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, query.pool, query.index);
+    return query;
+}
 
-    delete[] bindings;
-
-    VkPipelineShaderStageCreateInfo pipelineShaderInfo = {VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO};
-    pipelineShaderInfo.module = shaderModule;
-    pipelineShaderInfo.pName = kernelName;
-    pipelineShaderInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+void Profiler::end(VkCommandBuffer commandBuffer, Query query, const std::string &name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query.pool, query.index + 1);
+    recorded[commandBuffer].push_back({name, query});
+}
 
-    VkComputePipelineCreateInfo pipelineInfo = {VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO};
-    pipelineInfo.stage = pipelineShaderInfo;
-    pipelineInfo.layout = pipelineLayout;
-    if (VK_SUCCESS != vkCreateComputePipelines(this->device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &pipeline)) {
-        throw VKRTL_ERROR_PIPELINE;
+void Profiler::reset(VkCommandBuffer commandBuffer) {
+    std::lock_guard<std::mutex> lock(mutex);
+    bound.erase(commandBuffer);
+    auto it = recorded.find(commandBuffer);
+    if (it == recorded.end()) return;
+
+    // the queries may only be handed out again once the
+    // submissions of the command buffer have been read back
+    collect(false);
+    for (auto &submission : pending) {
+        if (submission.commandBuffer == commandBuffer) {
+            collect(true);
+            break;
+        }
     }
+    for (auto &record : it->second) freeQueries.push_back(record.query);
+    recorded.erase(it);
 }
 
-void Kernel::bindTo(VkCommandBuffer commandBuffer) {
-    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+void Profiler::submitted(VkCommandBuffer commandBuffer, Queue *queue, uint64_t serial) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = recorded.find(commandBuffer);
+    if (it == recorded.end()) return;
+    pending.push_back({commandBuffer, queue, serial, it->second, sinceOrigin(std::chrono::steady_clock::now())});
 }
 
-void Kernel::destroy() {
-    vkDestroyDescriptorSetLayout(device, descriptorSetLayout, nullptr);
-    vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
-    vkDestroyPipeline(device, pipeline, nullptr);
+// Read back the timestamps of the completed submissions, or of all of
+// them when block is set. The mutex must be held.
+void Profiler::collect(bool block) {
+    for (auto it = pending.begin(); it != pending.end();) {
+        if (block) {
+            it->queue->wait(it->serial);
+        } else if (!it->queue->isComplete(it->serial)) {
+            ++it;
+            continue;
+        }
+        for (auto &record : it->records) {
+            uint64_t timestamps[2];
+            if (VK_SUCCESS != vkGetQueryPoolResults(device, record.query.pool, record.query.index, 2,
+                                                    sizeof(timestamps), timestamps, sizeof(uint64_t),
+                                                    VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT)) {
+                continue;
+            }
+            double ms = ((timestamps[1] - timestamps[0]) & timestampMask) * timestampPeriod / 1e6;
+
+            // nothing starts before it was submitted, which bounds the
+            // offset from the device clock to the host timeline
+            double start = (timestamps[0] & timestampMask) * timestampPeriod / 1e3;
+            if (!calibrated || it->submitted - start > deviceOffset) {
+                deviceOffset = it->submitted - start;
+                calibrated = true;
+            }
+            uint32_t track = queueTracks.emplace(it->queue, (uint32_t)queueTracks.size()).first->second;
+            addSpan({record.name, true, track, start, ms * 1e3});
+            auto found = profiles.find(record.name);
+            if (found == profiles.end()) {
+                profiles[record.name] = {1, ms, ms, ms};
+            } else {
+                KernelProfile &profile = found->second;
+                profile.count++;
+                profile.totalMs += ms;
+                profile.minMs = std::min(profile.minMs, ms);
+                profile.maxMs = std::max(profile.maxMs, ms);
+            }
+        }
+        it = pending.erase(it);
+    }
+}
+
+void Profiler::hostSpan(const char *name, std::chrono::steady_clock::time_point start,
+                        std::chrono::steady_clock::time_point end) {
+    std::lock_guard<std::mutex> lock(mutex);
+    uint32_t track = threads.emplace(std::this_thread::get_id(), (uint32_t)threads.size()).first->second;
+    addSpan({name, false, track, sinceOrigin(start), sinceOrigin(end) - sinceOrigin(start)});
+}
+
+// The trace is bounded, so that a long profiled run does not grow it
+// without limit. The mutex must be held.
+void Profiler::addSpan(const Span &span) {
+    if (trace.size() < maxSpans) {
+        trace.push_back(span);
+    } else {
+        droppedSpans++;
+    }
+}
+
+static std::string escapeJson(const std::string &text) {
+    std::string escaped;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if ((unsigned char)c < 0x20) {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", (unsigned char)c);
+            escaped += code;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+bool Profiler::exportTrace(const char *fileName) {
+    std::lock_guard<std::mutex> lock(mutex);
+    collect(false);
+    std::ofstream fout(fileName);
+    if (!fout) return false;
+
+    // host threads are pid 0, device queues pid 1
+    fout << "{\"traceEvents\":[" << std::endl;
+    fout << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"host\"}}," << std::endl;
+    fout << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"device\"}}";
+    for (auto &track : queueTracks) {
+        fout << "," << std::endl << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << track.second
+             << ",\"args\":{\"name\":\"queue " << track.second << "\"}}";
+    }
+    fout << std::fixed << std::setprecision(3);
+    for (auto &span : trace) {
+        double start = span.onDevice ? span.start + deviceOffset : span.start;
+        fout << "," << std::endl << "{\"name\":\"" << escapeJson(span.name) << "\",\"cat\":\""
+             << (span.onDevice ? "device" : "host") << "\",\"ph\":\"X\",\"pid\":" << (span.onDevice ? 1 : 0)
+             << ",\"tid\":" << span.track << ",\"ts\":" << start << ",\"dur\":" << span.duration << "}";
+    }
+    fout << std::endl << "]}" << std::endl;
+    if (!fout) return false;
+
+    // the next export starts where this one ends
+    if (_verbose && droppedSpans > 0) {
+        std::cout << "[vkrtl] trace full, " << droppedSpans << " span(s) dropped" << std::endl;
+    }
+    trace.clear();
+    droppedSpans = 0;
+    return true;
+}
+
+std::map<std::string, KernelProfile> Profiler::getProfiles() {
+    std::lock_guard<std::mutex> lock(mutex);
+    collect(false);
+    return profiles;
+}
+
+void Profiler::summary() {
+    std::lock_guard<std::mutex> lock(mutex);
+    collect(true);
+    for (auto &entry : profiles) {
+        KernelProfile &profile = entry.second;
+        std::cout << "[vkrtl] profile " << entry.first << ": " << profile.count << " call(s), total "
+                  << profile.totalMs << "ms, avg " << profile.totalMs / profile.count << "ms, min "
+                  << profile.minMs << "ms, max " << profile.maxMs << "ms" << std::endl;
+    }
+}
+
+void Profiler::destroy() {
+    std::lock_guard<std::mutex> lock(mutex);
+    collect(true);
+    for (auto pool : pools) vkDestroyQueryPool(device, pool, nullptr);
+    pools.clear();
+    freeQueries.clear();
+    recorded.clear();
+    bound.clear();
+    trace.clear();
+}
+
+static VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+MemoryAllocator::MemoryAllocator(VkDevice device, VkPhysicalDeviceProperties &physicalDeviceProperties,
+        VkPhysicalDeviceMemoryProperties &physicalDeviceMemoryProperties, VkDeviceSize blockSize)
+    : device(device), memoryProperties(physicalDeviceMemoryProperties), blockSize(blockSize) {
+    nonCoherentAtomSize = physicalDeviceProperties.limits.nonCoherentAtomSize;
+    if (nonCoherentAtomSize == 0) nonCoherentAtomSize = 1;
+}
+
+VkDeviceSize MemoryAllocator::getBlockSize(uint32_t memoryType) {
+    // small heaps (e.g. the host visible window of a discrete GPU) are not
+    // filled up by a single block
+    VkDeviceSize heapSize = memoryProperties.memoryHeaps[memoryProperties.memoryTypes[memoryType].heapIndex].size;
+    return std::min(blockSize, alignUp(heapSize / 8, nonCoherentAtomSize));
+}
+
+bool MemoryAllocator::isCoherent(uint32_t memoryType) {
+    return memoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+}
+
+MemoryAllocator::Block *MemoryAllocator::createBlock(uint32_t memoryType, VkDeviceSize size) {
+    VkMemoryAllocateInfo memoryAllocateInfo = {VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO};
+    memoryAllocateInfo.allocationSize = size;
+    memoryAllocateInfo.memoryTypeIndex = memoryType;
+    VkDeviceMemory memory;
+    if (VK_SUCCESS != vkAllocateMemory(device, &memoryAllocateInfo, nullptr, &memory)) {
+        throw VKRTL_ERROR_MALLOC;
+    }
+
+    // Host visible blocks stay mapped for their whole lifetime. A memory
+    // object can only be mapped once, so the buffers sharing the block
+    // use the persistent mapping instead of mapping it themselves.
+    void *mapped = nullptr;
+    if (memoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        if (VK_SUCCESS != vkMapMemory(device, memory, 0, VK_WHOLE_SIZE, 0, &mapped)) {
+            vkFreeMemory(device, memory, nullptr);
+            throw VKRTL_ERROR_MAP;
+        }
+    }
+
+    Block *block = new Block();
+    block->memory = memory;
+    block->size = size;
+    block->used = 0;
+    block->memoryType = memoryType;
+    block->allocationCount = 0;
+    block->mapped = mapped;
+    block->freeRanges[0] = size;
+    blocks.push_back(block);
+
+    if (_verbose)
+        std::cout << "[vkrtl] allocate a memory block of " << size << " bytes (type "
+                  << memoryType << ")" << std::endl;
+    return block;
+}
+
+MemoryAllocator::Block *MemoryAllocator::findBlock(VkDeviceMemory memory) {
+    for (auto block : blocks) {
+        if (block->memory == memory) return block;
+    }
+    return nullptr;
+}
+
+Allocation MemoryAllocator::allocate(VkMemoryRequirements &memoryRequirements, uint32_t memoryType) {
+    VkDeviceSize alignment = memoryRequirements.alignment ? memoryRequirements.alignment : 1;
+    VkDeviceSize size = memoryRequirements.size;
+
+    // Ranges of non coherent memory are flushed and invalidated in units of
+    // nonCoherentAtomSize, so they must not share an atom with a neighbour.
+    if (!isCoherent(memoryType)) {
+        alignment = alignUp(alignment, nonCoherentAtomSize);
+        size = alignUp(size, nonCoherentAtomSize);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    // best fit: the smallest free range of this memory type that holds the request
+    Block *bestBlock = nullptr;
+    VkDeviceSize bestRangeOffset = 0, bestRangeSize = 0;
+    for (auto block : blocks) {
+        if (block->memoryType != memoryType || block->size - block->used < size) continue;
+        for (auto &range : block->freeRanges) {
+            VkDeviceSize offset = alignUp(range.first, alignment);
+            if (offset + size > range.first + range.second) continue;
+            if (bestBlock == nullptr || range.second < bestRangeSize) {
+                bestBlock = block;
+                bestRangeOffset = range.first;
+                bestRangeSize = range.second;
+            }
+        }
+    }
+
+    if (bestBlock == nullptr) {
+        // requests larger than half a block get a dedicated block
+        VkDeviceSize newBlockSize = getBlockSize(memoryType);
+        if (size > newBlockSize / 2) newBlockSize = alignUp(size, nonCoherentAtomSize);
+        bestBlock = createBlock(memoryType, newBlockSize);
+        bestRangeOffset = 0;
+        bestRangeSize = newBlockSize;
+    }
+
+    // carve the allocation out of the free range, giving back the
+    // alignment padding in front of it and the remainder behind it
+    VkDeviceSize offset = alignUp(bestRangeOffset, alignment);
+    bestBlock->freeRanges.erase(bestRangeOffset);
+    if (offset > bestRangeOffset) {
+        bestBlock->freeRanges[bestRangeOffset] = offset - bestRangeOffset;
+    }
+    if (offset + size < bestRangeOffset + bestRangeSize) {
+        bestBlock->freeRanges[offset + size] = bestRangeOffset + bestRangeSize - offset - size;
+    }
+    bestBlock->used += size;
+    bestBlock->allocationCount++;
+
+    Allocation allocation;
+    allocation.memory = bestBlock->memory;
+    allocation.offset = offset;
+    allocation.size = size;
+    allocation.memoryType = memoryType;
+    allocation.mapped = bestBlock->mapped ? (char *)bestBlock->mapped + offset : nullptr;
+    return allocation;
+}
+
+void MemoryAllocator::free(Allocation &allocation) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Block *block = findBlock(allocation.memory);
+    if (block == nullptr) return;
+
+    // give the range back, merging it with the adjacent free ranges
+    VkDeviceSize offset = allocation.offset;
+    VkDeviceSize size = allocation.size;
+    auto next = block->freeRanges.lower_bound(offset);
+    if (next != block->freeRanges.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == offset) {
+            offset = prev->first;
+            size += prev->second;
+            block->freeRanges.erase(prev);
+        }
+    }
+    if (next != block->freeRanges.end() && offset + size == next->first) {
+        size += next->second;
+        block->freeRanges.erase(next);
+    }
+    block->freeRanges[offset] = size;
+    block->used -= allocation.size;
+    block->allocationCount--;
+
+    // Release empty blocks, but keep one standard block per memory type
+    // around so that a create/destroy loop does not hit the driver each time.
+    if (block->allocationCount == 0) {
+        VkDeviceSize standardSize = getBlockSize(block->memoryType);
+        bool keep = block->size == standardSize;
+        for (auto other : blocks) {
+            if (other != block && other->memoryType == block->memoryType && other->size == standardSize) {
+                keep = false;
+                break;
+            }
+        }
+        if (!keep) {
+            if (block->mapped) vkUnmapMemory(device, block->memory);
+            vkFreeMemory(device, block->memory, nullptr);
+            for (auto it = blocks.begin(); it != blocks.end(); ++it) {
+                if (*it == block) {
+                    blocks.erase(it);
+                    break;
+                }
+            }
+            delete block;
+        }
+    }
+    allocation.memory = VK_NULL_HANDLE;
+}
+
+// Non coherent allocations start and end on a nonCoherentAtomSize boundary,
+// so widening the range to whole atoms never touches a neighbour.
+static VkMappedMemoryRange mappedRange(Allocation &allocation, VkDeviceSize offset, VkDeviceSize size,
+                                       VkDeviceSize atomSize) {
+    if (size == VK_WHOLE_SIZE || offset + size > allocation.size) size = allocation.size - offset;
+    VkDeviceSize begin = offset / atomSize * atomSize;
+    VkDeviceSize end = std::min(alignUp(offset + size, atomSize), allocation.size);
+    VkMappedMemoryRange range = {VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE};
+    range.memory = allocation.memory;
+    range.offset = allocation.offset + begin;
+    range.size = end - begin;
+    return range;
+}
+
+void MemoryAllocator::flush(Allocation &allocation, VkDeviceSize offset, VkDeviceSize size) {
+    if (isCoherent(allocation.memoryType)) return;
+    VkMappedMemoryRange range = mappedRange(allocation, offset, size, nonCoherentAtomSize);
+    if (VK_SUCCESS != vkFlushMappedMemoryRanges(device, 1, &range)) {
+        throw VKRTL_ERROR_MAP;
+    }
+}
+
+void MemoryAllocator::invalidate(Allocation &allocation, VkDeviceSize offset, VkDeviceSize size) {
+    if (isCoherent(allocation.memoryType)) return;
+    VkMappedMemoryRange range = mappedRange(allocation, offset, size, nonCoherentAtomSize);
+    if (VK_SUCCESS != vkInvalidateMappedMemoryRanges(device, 1, &range)) {
+        throw VKRTL_ERROR_MAP;
+    }
+}
+
+MemoryStats MemoryAllocator::getStats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    MemoryStats stats = {};
+    VkDeviceSize freeBytes = 0;
+    for (auto block : blocks) {
+        stats.blockCount++;
+        stats.allocationCount += block->allocationCount;
+        stats.blockBytes += block->size;
+        stats.usedBytes += block->used;
+        stats.freeRangeCount += block->freeRanges.size();
+        for (auto &range : block->freeRanges) {
+            freeBytes += range.second;
+            if (range.second > stats.largestFreeRange) stats.largestFreeRange = range.second;
+        }
+    }
+    stats.fragmentation = freeBytes ? 1.0f - (float)stats.largestFreeRange / freeBytes : 0.0f;
+    return stats;
+}
+
+void MemoryAllocator::destroy() {
+    for (auto block : blocks) {
+        if (block->mapped) vkUnmapMemory(device, block->memory);
+        vkFreeMemory(device, block->memory, nullptr);
+        delete block;
+    }
+    blocks.clear();
+}
+
+
+// The CommandPools not destroyed yet, which the threads exiting tell to
+// drop their pools. A thread exiting takes liveCommandPoolsMutex, then the
+// mutex of each CommandPools it has pools in.
+static std::mutex liveCommandPoolsMutex;
+static std::set<CommandPools *> liveCommandPools;
+
+struct ThreadPools {
+    std::vector<CommandPools *> owners;
+    ~ThreadPools() {
+        std::lock_guard<std::mutex> lock(liveCommandPoolsMutex);
+        for (CommandPools *owner : owners) {
+            if (liveCommandPools.count(owner)) owner->threadExit(std::this_thread::get_id());
+        }
+    }
+};
+static thread_local ThreadPools threadPools;
+
+CommandPools::CommandPools(VkDevice device) : device(device) {
+    std::lock_guard<std::mutex> lock(liveCommandPoolsMutex);
+    liveCommandPools.insert(this);
+}
+
+VkCommandBuffer CommandPools::acquire(uint32_t family, VkCommandPool &commandPool) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Pool *&pool = pools[std::make_pair(std::this_thread::get_id(), family)];
+    if (pool == nullptr) {
+        std::vector<CommandPools *> &owners = threadPools.owners;
+        if (std::find(owners.begin(), owners.end(), this) == owners.end()) owners.push_back(this);
+
+        // When we use VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT, we can
+        // reset command buffers individually, when they are recorded again.
+        VkCommandPoolCreateInfo commandPoolCreateInfo = {VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO};
+        commandPoolCreateInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+        commandPoolCreateInfo.queueFamilyIndex = family;
+        VkCommandPool handle;
+        if (VK_SUCCESS != vkCreateCommandPool(device, &commandPoolCreateInfo, nullptr, &handle)) {
+            throw VKRTL_ERROR_COMMAND_POOL;
+        }
+        pool = new Pool();
+        pool->pool = handle;
+        byHandle[handle] = pool;
+    }
+    commandPool = pool->pool;
+    pool->live++;
+    if (!pool->free.empty()) {
+        VkCommandBuffer commandBuffer = pool->free.back();
+        pool->free.pop_back();
+        return commandBuffer;
+    }
+
+    VkCommandBufferAllocateInfo commandBufferAllocateInfo = {VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO};
+    commandBufferAllocateInfo.commandBufferCount = 1;
+    commandBufferAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    commandBufferAllocateInfo.commandPool = pool->pool;
+    VkCommandBuffer commandBuffer;
+    if (VK_SUCCESS != vkAllocateCommandBuffers(device, &commandBufferAllocateInfo, &commandBuffer)) {
+        pool->live--;
+        throw VKRTL_ERROR_COMMAND_BUFFER;
+    }
+    return commandBuffer;
+}
+
+// The command buffer may be released from another thread than the one
+// recording into the pool: nothing is recorded from a pool without live
+// command buffers, so that is when the pool can be reset.
+void CommandPools::release(VkCommandPool commandPool, VkCommandBuffer commandBuffer) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Pool *pool = byHandle[commandPool];
+    pool->free.push_back(commandBuffer);
+    if (--pool->live > 0) return;
+    if (pool->orphaned) {
+        destroyPool(pool);
+    } else {
+        vkResetCommandPool(device, pool->pool, 0);
+    }
+}
+
+// Called with the mutex held.
+void CommandPools::destroyPool(Pool *pool) {
+    vkDestroyCommandPool(device, pool->pool, nullptr);
+    byHandle.erase(pool->pool);
+    delete pool;
+}
+
+// The command buffers of the thread may still be in flight, or held by
+// objects outliving it: their pool is kept until they are released.
+void CommandPools::threadExit(std::thread::id thread) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = pools.begin(); it != pools.end();) {
+        if (it->first.first != thread) {
+            ++it;
+            continue;
+        }
+        if (it->second->live == 0) {
+            destroyPool(it->second);
+        } else {
+            it->second->orphaned = true;
+        }
+        it = pools.erase(it);
+    }
+}
+
+void CommandPools::destroy() {
+    {
+        std::lock_guard<std::mutex> lock(liveCommandPoolsMutex);
+        liveCommandPools.erase(this);
+    }
+    for (auto &entry : byHandle) {
+        vkDestroyCommandPool(device, entry.first, nullptr);
+        delete entry.second;
+    }
+    byHandle.clear();
+    pools.clear();
+}
+
+// A set from the current pool, or from a new pool once all the pools are
+// exhausted. Pools hold 8 storage and 2 uniform buffers per set on average.
+VkDescriptorSet DescriptorAllocator::allocate(Pools &pools, VkDescriptorSetLayout layout) {
+    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo = {VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO};
+    descriptorSetAllocateInfo.descriptorSetCount = 1;
+    descriptorSetAllocateInfo.pSetLayouts = &layout;
+    VkDescriptorSet descriptorSet;
+    for (; pools.current < pools.pools.size(); pools.current++) {
+        descriptorSetAllocateInfo.descriptorPool = pools.pools[pools.current];
+        if (VK_SUCCESS == vkAllocateDescriptorSets(device, &descriptorSetAllocateInfo, &descriptorSet)) {
+            return descriptorSet;
+        }
+    }
+
+    VkDescriptorPoolSize descriptorPoolSizes[] = {{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 8 * setsPerPool},
+                                                  {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2 * setsPerPool}};
+    VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = {VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO};
+    descriptorPoolCreateInfo.maxSets = setsPerPool;
+    descriptorPoolCreateInfo.poolSizeCount = 2;
+    descriptorPoolCreateInfo.pPoolSizes = descriptorPoolSizes;
+    VkDescriptorPool descriptorPool;
+    if (VK_SUCCESS != vkCreateDescriptorPool(device, &descriptorPoolCreateInfo, nullptr, &descriptorPool)) {
+        throw VKRTL_ERROR_DESCRIPTOR;
+    }
+    pools.pools.push_back(descriptorPool);
+    pools.current = pools.pools.size() - 1;
+    if (_verbose) std::cout << "[vkrtl] new descriptor pool of " << setsPerPool << " sets" << std::endl;
+
+    // a set that does not fit in an empty pool never will
+    descriptorSetAllocateInfo.descriptorPool = descriptorPool;
+    if (VK_SUCCESS != vkAllocateDescriptorSets(device, &descriptorSetAllocateInfo, &descriptorSet)) {
+        throw VKRTL_ERROR_DESCRIPTOR;
+    }
+    return descriptorSet;
+}
+
+// A persistent pool none of whose sets is in use is reset: its free sets
+// are taken off the free lists, and the pool is handed out again.
+void DescriptorAllocator::recycle(VkDescriptorPool descriptorPool) {
+    auto inPool = [&](VkDescriptorSet descriptorSet) {
+        return persistentSets.find(descriptorSet)->second.pool == descriptorPool;
+    };
+    for (auto &entry : freeSets) {
+        std::vector<VkDescriptorSet> &free = entry.second;
+        free.erase(std::remove_if(free.begin(), free.end(), inPool), free.end());
+    }
+    for (auto it = persistentSets.begin(); it != persistentSets.end();) {
+        if (it->second.pool == descriptorPool) {
+            it = persistentSets.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    vkResetDescriptorPool(device, descriptorPool, 0);
+    std::vector<VkDescriptorPool> &pools = persistent.pools;
+    size_t index = std::find(pools.begin(), pools.end(), descriptorPool) - pools.begin();
+    persistent.current = std::min(persistent.current, index);
+    if (_verbose) std::cout << "[vkrtl] recycle an empty descriptor pool" << std::endl;
+}
+
+VkDescriptorSet DescriptorAllocator::allocate(VkDescriptorSetLayout layout) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<VkDescriptorSet> &free = freeSets[layout];
+    VkDescriptorSet descriptorSet;
+    if (!free.empty()) {
+        descriptorSet = free.back();
+        free.pop_back();
+    } else {
+        descriptorSet = allocate(persistent, layout);
+        PersistentSet &persistentSet = persistentSets[descriptorSet];
+        persistentSet.pool = persistent.pools[persistent.current];
+        persistentSet.layout = layout;
+        persistentSet.forgotten = false;
+    }
+    liveSets[persistentSets[descriptorSet].pool]++;
+    return descriptorSet;
+}
+
+// A set of a forgotten layout is not given to the layout that may have
+// taken its handle since: it stays in its pool until the pool is recycled.
+void DescriptorAllocator::free(VkDescriptorSetLayout layout, VkDescriptorSet descriptorSet) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = persistentSets.find(descriptorSet);
+    if (found == persistentSets.end()) return;
+    VkDescriptorPool descriptorPool = found->second.pool;
+    if (found->second.forgotten || found->second.layout != layout) {
+        persistentSets.erase(found);
+    } else {
+        freeSets[layout].push_back(descriptorSet);
+    }
+    if (--liveSets[descriptorPool] == 0) recycle(descriptorPool);
+}
+
+// The sets stay allocated in their pool: a new layout may get the handle
+// of the destroyed one, and must not be given them. The free ones are
+// dropped, and the ones still in use are dropped when they are given back.
+void DescriptorAllocator::forget(VkDescriptorSetLayout layout) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = freeSets.find(layout);
+    if (found != freeSets.end()) {
+        for (VkDescriptorSet descriptorSet : found->second) persistentSets.erase(descriptorSet);
+        freeSets.erase(found);
+    }
+    for (auto &entry : persistentSets) {
+        if (entry.second.layout == layout) entry.second.forgotten = true;
+    }
+}
+
+VkDescriptorSet DescriptorAllocator::allocateTransient(VkDescriptorSetLayout layout) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return allocate(transient, layout);
+}
+
+void DescriptorAllocator::nextEpoch() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (VkDescriptorPool descriptorPool : transient.pools) vkResetDescriptorPool(device, descriptorPool, 0);
+    transient.current = 0;
+}
+
+void DescriptorAllocator::destroy() {
+    for (VkDescriptorPool descriptorPool : persistent.pools) vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+    for (VkDescriptorPool descriptorPool : transient.pools) vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+    persistent.pools.clear();
+    transient.pools.clear();
+    freeSets.clear();
+    persistentSets.clear();
+    liveSets.clear();
+}
+
+// An entry leaves the cache for good: its set goes back to the allocator.
+void DescriptorCache::erase(std::list<Entry>::iterator entry) {
+    allocator->free(entry->layout, entry->descriptorSet);
+    bySet.erase(entry->descriptorSet);
+    entries.erase(entry);
+}
+
+// An entry that must not be found any more, e.g. bound to a destroyed
+// buffer, is erased once the last Arguments using it is destroyed.
+void DescriptorCache::uncache(std::list<Entry>::iterator entry) {
+    if (entry->cached) byKey.erase(entry->key);
+    entry->cached = false;
+    if (entry->users == 0) erase(entry);
+}
+
+void DescriptorCache::evict() {
+    auto entry = entries.end();
+    while (entries.size() > capacity && entry != entries.begin()) {
+        --entry;
+        if (entry->users > 0) continue;
+        if (entry->cached) byKey.erase(entry->key);
+        auto next = entry;
+        ++next;
+        erase(entry);
+        entry = next;
+    }
+}
+
+VkDescriptorSet DescriptorCache::acquire(VkDescriptorSetLayout layout,
+                                         const std::vector<VkDescriptorBufferInfo> &bufferInfos,
+                                         std::function<void(VkDescriptorSet)> write) {
+    std::string key((const char *)&layout, sizeof(layout));
+    for (auto &bufferInfo : bufferInfos) {
+        key.append((const char *)&bufferInfo.buffer, sizeof(bufferInfo.buffer));
+        key.append((const char *)&bufferInfo.offset, sizeof(bufferInfo.offset));
+        key.append((const char *)&bufferInfo.range, sizeof(bufferInfo.range));
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = byKey.find(key);
+    if (found != byKey.end()) {
+        // move the entry to the front of the list
+        entries.splice(entries.begin(), entries, found->second);
+        found->second->users++;
+        return found->second->descriptorSet;
+    }
+
+    Entry entry;
+    entry.key = key;
+    entry.layout = layout;
+    entry.descriptorSet = allocator->allocate(layout);
+    for (auto &bufferInfo : bufferInfos) entry.buffers.push_back(bufferInfo.buffer);
+    entry.users = 1;
+    entry.cached = true;
+    write(entry.descriptorSet);
+    entries.push_front(entry);
+    byKey[key] = entries.begin();
+    bySet[entry.descriptorSet] = entries.begin();
+    evict();
+    return entry.descriptorSet;
+}
+
+void DescriptorCache::release(VkDescriptorSet descriptorSet) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = bySet.find(descriptorSet);
+    if (found == bySet.end()) return;
+    auto entry = found->second;
+    entry->users--;
+    if (!entry->cached && entry->users == 0) {
+        erase(entry);
+    } else {
+        evict();
+    }
+}
+
+void DescriptorCache::invalidate(VkBuffer buffer) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto entry = entries.begin(); entry != entries.end();) {
+        auto next = entry;
+        ++next;
+        if (std::find(entry->buffers.begin(), entry->buffers.end(), buffer) != entry->buffers.end()) {
+            uncache(entry);
+        }
+        entry = next;
+    }
+}
+
+void DescriptorCache::forget(VkDescriptorSetLayout layout) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto entry = entries.begin(); entry != entries.end();) {
+        auto next = entry;
+        ++next;
+        if (entry->layout == layout) uncache(entry);
+        entry = next;
+    }
+}
+
+// the sets themselves are released with the pools of the allocator
+void DescriptorCache::destroy() {
+    entries.clear();
+    byKey.clear();
+    bySet.clear();
+}
+
+void CommandBuffer::sharedConstructor(uint32_t queueFamily, bool ownPool) {
+    this->ownPool = ownPool;
+    if (!ownPool) {
+        commandBuffer = commandPools->acquire(queueFamily, commandPool);
+        return;
+    }
+
+    // Command pools are used mainly as a source of memory for the command buffers
+    // When we use VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT, we can reset
+    // command buffers individually. Command pools also control the queues to which
+    // command buffers can be submitted. This is achieved through a queue family index
+    VkCommandPoolCreateInfo commandPoolCreateInfo = {VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO};
+    commandPoolCreateInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    commandPoolCreateInfo.queueFamilyIndex = queueFamily;
+    if (VK_SUCCESS != vkCreateCommandPool(context->device, &commandPoolCreateInfo, nullptr, &commandPool)) {
+        throw VKRTL_ERROR_COMMAND_POOL;
+    }
+
+    // Command buffers are allocated from command pools and can be submitted
+    // only to queues from the specified family.
+    VkCommandBufferAllocateInfo commandBufferAllocateInfo = {VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO};
+    commandBufferAllocateInfo.commandBufferCount = 1;
+    // Primary command buffers can be directly submitted to queues.
+    commandBufferAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    commandBufferAllocateInfo.commandPool = commandPool;
+    if (VK_SUCCESS != vkAllocateCommandBuffers(context->device, &commandBufferAllocateInfo, &commandBuffer)) {
+        throw VKRTL_ERROR_COMMAND_BUFFER;
+    }
+}
+
+CommandBuffer::CommandBuffer(Device &device) : Device(device) {
+    sharedConstructor(computeQueueFamily, false);
+}
+
+CommandBuffer::CommandBuffer(Device &device, uint32_t queueFamily) : Device(device) {
+    sharedConstructor(queueFamily, true);
+}
+
+CommandBuffer::CommandBuffer(Device &device, Kernel &kernel, Arguments &arguments) : Device(device) {
+    sharedConstructor(computeQueueFamily, false);
+    begin();
+    arguments.bindTo(*this);
+    kernel.bindTo(*this);
+}
+
+CommandBuffer::CommandBuffer(CommandBuffer &&other)
+    : Device(other), commandBuffer(other.commandBuffer), commandPool(other.commandPool), ownPool(other.ownPool) {
+    other.commandBuffer = VK_NULL_HANDLE;
+}
+
+CommandBuffer &CommandBuffer::operator=(CommandBuffer &&other) {
+    if (this != &other) {
+        if (commandBuffer != VK_NULL_HANDLE && !context->destroyed) destroy();
+        Device::operator=(other);
+        commandBuffer = other.commandBuffer;
+        commandPool = other.commandPool;
+        ownPool = other.ownPool;
+        other.commandBuffer = VK_NULL_HANDLE;
+    }
+    return *this;
+}
+
+CommandBuffer::~CommandBuffer() {
+    if (commandBuffer != VK_NULL_HANDLE && !context->destroyed) destroy();
+}
+
+void CommandBuffer::destroy() {
+    if (commandBuffer == VK_NULL_HANDLE) return;
+    if (context->profiler) context->profiler->reset(commandBuffer);
+    if (!ownPool) {
+        commandPools->release(commandPool, commandBuffer);
+    } else {
+        vkFreeCommandBuffers(context->device, commandPool, 1, &commandBuffer);
+        vkDestroyCommandPool(context->device, commandPool, nullptr);
+    }
+    commandBuffer = VK_NULL_HANDLE;
+}
+
+CommandBuffer::operator VkCommandBuffer() {
+    return commandBuffer;
+}
+
+void CommandBuffer::begin(VkCommandBufferUsageFlags flags) {
+    if (context->profiler) context->profiler->reset(commandBuffer);
+    VkCommandBufferBeginInfo commandBufferBeginInfo = {VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
+    commandBufferBeginInfo.flags = flags;
+    if (VK_SUCCESS != vkBeginCommandBuffer(commandBuffer, &commandBufferBeginInfo)) {
+        throw VKRTL_ERROR_COMMAND_BUFFER;
+    }
+}
+
+void CommandBuffer::barrier() {
+    VkMemoryBarrier memoryBarrier = {VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+    memoryBarrier.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+    Profiler::Query query;
+    if (context->profiler) query = context->profiler->begin(commandBuffer);
+    vkCmdPipelineBarrier(commandBuffer,
+            VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+            VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 1,
+            &memoryBarrier, 0, nullptr, 0, nullptr);
+    if (context->profiler) context->profiler->end(commandBuffer, query, "barrier");
+}
+
+// barrier on a range of a buffer, used by a single queue family
+static VkBufferMemoryBarrier bufferMemoryBarrier(VkBuffer buffer, VkAccessFlags srcAccessMask,
+                                                 VkAccessFlags dstAccessMask, VkDeviceSize offset = 0,
+                                                 VkDeviceSize size = VK_WHOLE_SIZE) {
+    VkBufferMemoryBarrier bufferMemoryBarrier = {VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER};
+    bufferMemoryBarrier.srcAccessMask = srcAccessMask;
+    bufferMemoryBarrier.dstAccessMask = dstAccessMask;
+    bufferMemoryBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    bufferMemoryBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    bufferMemoryBarrier.buffer = buffer;
+    bufferMemoryBarrier.offset = offset;
+    bufferMemoryBarrier.size = size;
+    return bufferMemoryBarrier;
+}
+
+void CommandBuffer::barrier(VkPipelineStageFlags srcStage, VkPipelineStageFlags dstStage,
+                            const std::vector<VkBufferMemoryBarrier> &bufferMemoryBarriers) {
+    Profiler::Query query;
+    if (context->profiler) query = context->profiler->begin(commandBuffer);
+    vkCmdPipelineBarrier(commandBuffer, srcStage, dstStage, 0, 0, nullptr, (uint32_t)bufferMemoryBarriers.size(),
+                         bufferMemoryBarriers.data(), 0, nullptr);
+    if (context->profiler) context->profiler->end(commandBuffer, query, "barrier");
+}
+
+void CommandBuffer::barrier(BarrierType type, std::vector<BufferRange> ranges) {
+    VkPipelineStageFlags srcStage, dstStage;
+    VkAccessFlags srcAccessMask, dstAccessMask;
+    switch (type) {
+    case COMPUTE_TO_COMPUTE:
+        srcStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+        dstStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+        srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        break;
+    case COMPUTE_TO_TRANSFER:
+        srcStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+        dstStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+        srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+        break;
+    case TRANSFER_TO_COMPUTE:
+        srcStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+        dstStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+        srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        break;
+    case COMPUTE_TO_HOST:
+        // for mapped buffers read once the submission has completed
+        srcStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+        dstStage = VK_PIPELINE_STAGE_HOST_BIT;
+        srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+        break;
+    default:
+        throw VKRTL_ERROR_COMMAND_BUFFER;
+    }
+
+    if (ranges.empty()) {
+        VkMemoryBarrier memoryBarrier = {VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+        memoryBarrier.srcAccessMask = srcAccessMask;
+        memoryBarrier.dstAccessMask = dstAccessMask;
+        Profiler::Query query;
+        if (context->profiler) query = context->profiler->begin(commandBuffer);
+        vkCmdPipelineBarrier(commandBuffer, srcStage, dstStage, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+        if (context->profiler) context->profiler->end(commandBuffer, query, "barrier");
+        return;
+    }
+    std::vector<VkBufferMemoryBarrier> bufferMemoryBarriers;
+    for (BufferRange &range : ranges) {
+        bufferMemoryBarriers.push_back(
+            bufferMemoryBarrier(range.buffer, srcAccessMask, dstAccessMask, range.offset, range.size));
+    }
+    barrier(srcStage, dstStage, bufferMemoryBarriers);
+}
+
+void CommandBuffer::dispatch(int x, int y, int z) {
+    Profiler::Query query;
+    if (context->profiler) query = context->profiler->begin(commandBuffer);
+    vkCmdDispatch(commandBuffer, x, y, z);
+    if (context->profiler) context->profiler->end(commandBuffer, query, context->profiler->getBound(commandBuffer));
+}
+
+void CommandBuffer::enqueueNDRange(Kernel &kernel, Arguments &arguments, NDRange globalSize, NDRange localSize) {
+    const VkPhysicalDeviceLimits &limits = context->physicalDeviceProperties.limits;
+    const uint32_t *kernelLocalSize = kernel.getLocalSize();
+    uint32_t global[3] = {globalSize.x, globalSize.y, globalSize.z};
+    uint32_t local[3] = {localSize.x, localSize.y, localSize.z};
+
+    // the local size is baked in the pipeline, it cannot change per launch
+    if (localSize.x != 0) {
+        for (int d = 0; d < 3; d++) {
+            if (local[d] != kernelLocalSize[d]) throw VKRTL_ERROR_NDRANGE;
+        }
+    }
+    // The kernel cannot tell the work items past globalSize from the others:
+    // it is neither passed to it, nor reported by get_global_size, which
+    // counts whole groups. A partial group would write past the buffers.
+    uint32_t invocations = 1;
+    for (int d = 0; d < 3; d++) {
+        if (global[d] % kernelLocalSize[d] != 0) throw VKRTL_ERROR_NDRANGE;
+        if (kernelLocalSize[d] > limits.maxComputeWorkGroupSize[d]) throw VKRTL_ERROR_NDRANGE;
+        invocations *= kernelLocalSize[d];
+    }
+    if (invocations > limits.maxComputeWorkGroupInvocations) throw VKRTL_ERROR_NDRANGE;
+
+    uint32_t groupCount[3];
+    kernel.getGroupCount(global[0], global[1], global[2], groupCount);
+    bool split = false;
+    for (int d = 0; d < 3; d++) {
+        if (groupCount[d] == 0) return;
+        if (groupCount[d] > limits.maxComputeWorkGroupCount[d]) split = true;
+    }
+    if (split && context->vkCmdDispatchBase == nullptr) throw VKRTL_ERROR_NDRANGE;
+
+    arguments.bindTo(commandBuffer);
+    kernel.bindTo(commandBuffer);
+    Profiler::Query query;
+    if (context->profiler) query = context->profiler->begin(commandBuffer);
+    if (!split) {
+        vkCmdDispatch(commandBuffer, groupCount[0], groupCount[1], groupCount[2]);
+    } else {
+        // tile the grid with dispatches of at most maxComputeWorkGroupCount
+        // groups, each offset by its base so the shader sees global ids
+        const uint32_t *maxCount = limits.maxComputeWorkGroupCount;
+        for (uint32_t z = 0; z < groupCount[2]; z += maxCount[2]) {
+            for (uint32_t y = 0; y < groupCount[1]; y += maxCount[1]) {
+                for (uint32_t x = 0; x < groupCount[0]; x += maxCount[0]) {
+                    context->vkCmdDispatchBase(commandBuffer, x, y, z, std::min(maxCount[0], groupCount[0] - x),
+                                               std::min(maxCount[1], groupCount[1] - y),
+                                               std::min(maxCount[2], groupCount[2] - z));
+                }
+            }
+        }
+    }
+    if (context->profiler) context->profiler->end(commandBuffer, query, context->profiler->getBound(commandBuffer));
+}
+
+void CommandBuffer::pushArguments(Kernel &kernel, BufferList resources) {
+    kernel.pushArguments(commandBuffer, resources);
+}
+
+void CommandBuffer::pushConstants(Kernel &kernel, const void *data, uint32_t byteSize, uint32_t offset) {
+    kernel.pushConstants(commandBuffer, data, byteSize, offset);
+}
+
+void CommandBuffer::end() {
+    if (VK_SUCCESS != vkEndCommandBuffer(commandBuffer)) {
+        throw VKRTL_ERROR_COMMAND_BUFFER;
+    }
+}
+
+Buffer::Buffer(Device &device, size_t byteSize, bool mappable) : context(device.getContext()), byteSize(byteSize) {
+    TraceSpan span(context->profiler, "Buffer::Buffer");
+    // create buffer
+    VkBufferCreateInfo bufferCreateInfo = {VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
+    bufferCreateInfo.size = byteSize;
+    // specifies that the buffer can be used in a VkDescriptorBufferInfo suitable
+    // for occupying a VkDescriptorSet slot either of type
+    // VK_DESCRIPTOR_TYPE_STORAGE_BUFFER or VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC
+    bufferCreateInfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+    // specifies that the buffer can be used as the source of a transfer command
+    bufferCreateInfo.usage |= VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    // specifies that the buffer can be used as the destination of a transfer command
+    bufferCreateInfo.usage |= VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    if (VK_SUCCESS != vkCreateBuffer(context->device, &bufferCreateInfo, nullptr, &buffer)) {
+        throw VKRTL_ERROR_CREATE_BUFFER;
+    }
+
+    // get memory requirements
+    VkMemoryRequirements memoryRequirements;
+    vkGetBufferMemoryRequirements(context->device, buffer, &memoryRequirements);
+
+    // sub-allocate memory for the buffer from one of the device blocks
+    int memoryType = mappable ? context->memoryTypeMappable : context->memoryTypeLocal;
+    allocation = context->allocator->allocate(memoryRequirements, memoryType);
+
+    // bind memory to the buffer at its offset inside the block
+    if (VK_SUCCESS != vkBindBufferMemory(context->device, buffer, allocation.memory, allocation.offset)) {
+        context->allocator->free(allocation);
+        throw VKRTL_ERROR_MALLOC;
+    }
+
+    if (_verbose) {
+        std::string info = "";
+        if (mappable) info = "mappable ";
+        std::cout << "[vrtl] Create a "<< info << "buffer of " <<
+            byteSize << " bytes" << std::endl;
+    }
+}
+
+Buffer::Buffer(Buffer &&other)
+    : context(std::move(other.context)), allocation(other.allocation), buffer(other.buffer), byteSize(other.byteSize) {
+    other.buffer = VK_NULL_HANDLE;
+}
+
+Buffer &Buffer::operator=(Buffer &&other) {
+    if (this != &other) {
+        if (buffer != VK_NULL_HANDLE && !context->destroyed) destroy();
+        context = std::move(other.context);
+        allocation = other.allocation;
+        buffer = other.buffer;
+        byteSize = other.byteSize;
+        other.buffer = VK_NULL_HANDLE;
+    }
+    return *this;
+}
+
+// Once the device is destroyed, its memory is gone with it.
+Buffer::~Buffer() {
+    if (buffer != VK_NULL_HANDLE && !context->destroyed) destroy();
+}
+
+void Buffer::enqueueCopy(Buffer &src, Buffer &dst, size_t byteSize, VkCommandBuffer commandBuffer) {
+    VkBufferCopy bufferCopy = {0, 0, byteSize};
+    Profiler::Query query;
+    if (context->profiler) query = context->profiler->begin(commandBuffer);
+    vkCmdCopyBuffer(commandBuffer, src.buffer, dst.buffer, 1, &bufferCopy);
+    if (context->profiler) context->profiler->end(commandBuffer, query, "copy");
+}
+
+void Buffer::inload(void *hostPtr) {
+    TraceSpan span(context->profiler, "Buffer::inload");
+    context->stagingRing->download(buffer, 0, hostPtr, byteSize).wait();
+}
+
+void Buffer::offload(void *hostPtr) {
+    context->stagingRing->upload(buffer, 0, hostPtr, byteSize);
+}
+
+Event Buffer::inloadAsync(void *hostPtr) {
+    return context->stagingRing->download(buffer, 0, hostPtr, byteSize);
+}
+
+Event Buffer::offloadAsync(void *hostPtr) {
+    return context->stagingRing->upload(buffer, 0, hostPtr, byteSize);
+}
+
+BufferRange::BufferRange(Buffer &buffer, VkDeviceSize offset, VkDeviceSize size)
+    : buffer(buffer), offset(offset), size(size) {}
+
+Buffer::operator VkBuffer() {
+    return buffer;
+}
+
+VkDeviceSize Buffer::getSize() {
+    return byteSize;
+}
+
+void Buffer::destroy() {
+    if (buffer == VK_NULL_HANDLE) return;
+    if (_verbose) {
+        // get memory requirements
+        VkMemoryRequirements memoryRequirements;
+        vkGetBufferMemoryRequirements(context->device, buffer, &memoryRequirements);
+        std::cout << "[vkrtl] destroy buffer. Size equals " << memoryRequirements.size << std::endl;
+    }
+    context->descriptorCache->invalidate(buffer);
+    vkDestroyBuffer(context->device, buffer, nullptr);
+    context->allocator->free(allocation);
+    buffer = VK_NULL_HANDLE;
+}
+
+void Buffer::unmap() {
+    // the block stays mapped, only host writes have to be made visible
+    context->allocator->flush(allocation);
+}
+
+void *Buffer::map() {
+    if (allocation.mapped == nullptr) {
+        throw VKRTL_ERROR_MAP;
+    }
+    context->allocator->invalidate(allocation);
+    return allocation.mapped;
+}
+
+StagingRing::StagingRing(Device &device, VkDeviceSize ringSize) : Device(device), ringSize(ringSize) {
+    ring = new Buffer(device, ringSize, true);
+    mapped = (char *)ring->allocation.mapped;
+
+    // slices start on boundaries that suit both the copy engine and
+    // the flush of non coherent memory
+    alignment = std::max<VkDeviceSize>(context->physicalDeviceProperties.limits.optimalBufferCopyOffsetAlignment,
+                                       context->physicalDeviceProperties.limits.nonCoherentAtomSize);
+    if (alignment == 0) alignment = 1;
+}
+
+// Give back the space of the slices whose submission has completed.
+// When block is set, wait for the oldest slice first.
+void StagingRing::retire(bool block) {
+    while (!inFlight.empty()) {
+        Slice &slice = inFlight.front();
+        if (block) {
+            slice.queue->wait(slice.serial);
+            block = false;
+        } else if (!slice.queue->isComplete(slice.serial)) {
+            break;
+        }
+        if (slice.hostPtr) {
+            context->allocator->invalidate(ring->allocation, slice.offset, slice.size);
+            memcpy(slice.hostPtr, mapped + slice.offset, slice.size);
+        }
+        used -= slice.bytes;
+        freeSlices.push_back(slice);
+        inFlight.pop_front();
+    }
+    if (inFlight.empty()) {
+        head = 0;
+        used = 0;
+    }
+}
+
+// Reserve byteSize contiguous bytes of the ring and return their offset.
+// bytes receives the space actually consumed, which includes the end of
+// the ring skipped when the slice wraps around.
+VkDeviceSize StagingRing::reserve(VkDeviceSize byteSize, VkDeviceSize &bytes) {
+    retire(false);
+    while (true) {
+        VkDeviceSize offset = alignUp(head, alignment);
+        if (offset + byteSize <= ringSize) {
+            bytes = offset + byteSize - head;
+        } else {
+            offset = 0;
+            bytes = ringSize - head + byteSize;
+        }
+        if (used + bytes <= ringSize) {
+            head = offset + byteSize;
+            used += bytes;
+            return offset;
+        }
+        retire(true);
+    }
+}
+
+StagingRing::Slice StagingRing::acquireSlice() {
+    Slice slice;
+    if (!freeSlices.empty()) {
+        slice = freeSlices.back();
+        freeSlices.pop_back();
+    } else {
+        // slices are recorded by whichever thread transfers
+        slice.commandBuffer = new CommandBuffer(*this, computeQueueFamily);
+        slice.transfer = nullptr;
+        slice.release = nullptr;
+        if (transferQueue) {
+            slice.transfer = new CommandBuffer(*this, transferQueueFamily);
+            slice.release = new CommandBuffer(*this, computeQueueFamily);
+        }
+    }
+    slice.sequence = ++sequence;
+    slice.hostPtr = nullptr;
+    return slice;
+}
+
+// Record the release (on the queue giving the buffer away) or the acquire
+// (on the queue receiving it) half of a queue family ownership transfer
+// between the transfer family and the compute family.
+void StagingRing::ownershipBarrier(VkCommandBuffer commandBuffer, VkBuffer buffer, VkDeviceSize offset,
+                                   VkDeviceSize size, bool toCompute, bool release) {
+    VkBufferMemoryBarrier bufferMemoryBarrier = {VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER};
+    bufferMemoryBarrier.srcQueueFamilyIndex = toCompute ? transferQueueFamily : computeQueueFamily;
+    bufferMemoryBarrier.dstQueueFamilyIndex = toCompute ? computeQueueFamily : transferQueueFamily;
+    bufferMemoryBarrier.buffer = buffer;
+    bufferMemoryBarrier.offset = offset;
+    bufferMemoryBarrier.size = size;
+    VkPipelineStageFlags srcStage, dstStage;
+    if (release) {
+        bufferMemoryBarrier.srcAccessMask = toCompute ? VK_ACCESS_TRANSFER_WRITE_BIT : VK_ACCESS_MEMORY_WRITE_BIT;
+        srcStage = toCompute ? VK_PIPELINE_STAGE_TRANSFER_BIT : VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+        dstStage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+    } else {
+        bufferMemoryBarrier.dstAccessMask = toCompute ? VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT
+                                                      : VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+        srcStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+        dstStage = toCompute ? VK_PIPELINE_STAGE_ALL_COMMANDS_BIT : VK_PIPELINE_STAGE_TRANSFER_BIT;
+    }
+    vkCmdPipelineBarrier(commandBuffer, srcStage, dstStage, 0, 0, nullptr, 1, &bufferMemoryBarrier, 0, nullptr);
+}
+
+Event StagingRing::upload(VkBuffer dst, VkDeviceSize dstOffset, const void *hostPtr, VkDeviceSize byteSize) {
+    TraceSpan span(context->profiler, "StagingRing::upload");
+    std::lock_guard<std::mutex> lock(mutex);
+    for (VkDeviceSize done = 0; done < byteSize;) {
+        VkDeviceSize chunk = std::min(byteSize - done, ringSize / 2);
+        VkDeviceSize bytes;
+        VkDeviceSize offset = reserve(chunk, bytes);
+        memcpy(mapped + offset, (const char *)hostPtr + done, chunk);
+        context->allocator->flush(ring->allocation, offset, chunk);
+
+        Slice slice = acquireSlice();
+        slice.bytes = bytes;
+        slice.queue = queues->select();
+        VkBufferCopy bufferCopy = {offset, dstOffset + done, chunk};
+
+        if (transferQueue) {
+            // the compute queue releases dst once the commands submitted
+            // before are done with it
+            CommandBuffer &release = *slice.release;
+            release.begin();
+            ownershipBarrier(release, dst, bufferCopy.dstOffset, chunk, false, true);
+            release.end();
+            SemaphoreOperation released = {slice.queue->getSemaphore(), slice.queue->submit(release),
+                                           VK_PIPELINE_STAGE_TRANSFER_BIT};
+
+            // copy on the transfer queue and hand dst back to the compute
+            // queue, which waits for the copy on the GPU, not on the host
+            CommandBuffer &transfer = *slice.transfer;
+            transfer.begin();
+            ownershipBarrier(transfer, dst, bufferCopy.dstOffset, chunk, false, false);
+            vkCmdCopyBuffer(transfer, *ring, dst, 1, &bufferCopy);
+            ownershipBarrier(transfer, dst, bufferCopy.dstOffset, chunk, true, true);
+            transfer.end();
+            SemaphoreOperation copied = {transferQueue->getSemaphore(), transferQueue->submit(transfer, 1, &released),
+                                         VK_PIPELINE_STAGE_ALL_COMMANDS_BIT};
+
+            CommandBuffer &commandBuffer = *slice.commandBuffer;
+            commandBuffer.begin();
+            ownershipBarrier(commandBuffer, dst, bufferCopy.dstOffset, chunk, true, false);
+            commandBuffer.end();
+            slice.serial = slice.queue->submit(commandBuffer, 1, &copied);
+        } else {
+            CommandBuffer &commandBuffer = *slice.commandBuffer;
+            commandBuffer.begin();
+
+            // keep the copy from overwriting dst while the commands
+            // submitted before still read or write it
+            VkMemoryBarrier writeBarrier = {VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+            writeBarrier.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+            writeBarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                 0, 1, &writeBarrier, 0, nullptr, 0, nullptr);
+            Profiler::Query query;
+            if (context->profiler) query = context->profiler->begin(commandBuffer);
+            vkCmdCopyBuffer(commandBuffer, *ring, dst, 1, &bufferCopy);
+            if (context->profiler) context->profiler->end(commandBuffer, query, "upload");
+
+            // make the copy visible to every command submitted after it
+            VkMemoryBarrier memoryBarrier = {VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+            memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            memoryBarrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                                 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+            commandBuffer.end();
+            slice.serial = slice.queue->submit(commandBuffer);
+            if (context->profiler) context->profiler->submitted(commandBuffer, slice.queue, slice.serial);
+        }
+        inFlight.push_back(slice);
+        done += chunk;
+    }
+    if (inFlight.empty()) return Event();
+    return Event(inFlight.back().queue, inFlight.back().serial, this, inFlight.back().sequence);
+}
+
+Event StagingRing::download(VkBuffer src, VkDeviceSize srcOffset, void *hostPtr, VkDeviceSize byteSize) {
+    TraceSpan span(context->profiler, "StagingRing::download");
+    std::lock_guard<std::mutex> lock(mutex);
+    for (VkDeviceSize done = 0; done < byteSize;) {
+        VkDeviceSize chunk = std::min(byteSize - done, ringSize / 2);
+        VkDeviceSize bytes;
+        VkDeviceSize offset = reserve(chunk, bytes);
+
+        Slice slice = acquireSlice();
+        slice.bytes = bytes;
+        slice.hostPtr = (char *)hostPtr + done;
+        slice.offset = offset;
+        slice.size = chunk;
+        slice.queue = queues->select();
+        VkBufferCopy bufferCopy = {srcOffset + done, offset, chunk};
+
+        // make the copy visible to the host
+        VkMemoryBarrier memoryBarrier = {VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+        memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        memoryBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+
+        if (transferQueue) {
+            // the compute queue releases src once the commands submitted
+            // before are done with it
+            CommandBuffer &release = *slice.release;
+            release.begin();
+            ownershipBarrier(release, src, bufferCopy.srcOffset, chunk, false, true);
+            release.end();
+            SemaphoreOperation released = {slice.queue->getSemaphore(), slice.queue->submit(release),
+                                           VK_PIPELINE_STAGE_TRANSFER_BIT};
+
+            // the transfer queue acquires src, copies it, and gives it back
+            CommandBuffer &transfer = *slice.transfer;
+            transfer.begin();
+            ownershipBarrier(transfer, src, bufferCopy.srcOffset, chunk, false, false);
+            vkCmdCopyBuffer(transfer, src, *ring, 1, &bufferCopy);
+            vkCmdPipelineBarrier(transfer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
+                                 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+            ownershipBarrier(transfer, src, bufferCopy.srcOffset, chunk, true, true);
+            transfer.end();
+            SemaphoreOperation copied = {transferQueue->getSemaphore(), transferQueue->submit(transfer, 1, &released),
+                                         VK_PIPELINE_STAGE_ALL_COMMANDS_BIT};
+
+            // and the compute queue acquires src back before the commands
+            // submitted afterwards may write to it
+            CommandBuffer &commandBuffer = *slice.commandBuffer;
+            commandBuffer.begin();
+            ownershipBarrier(commandBuffer, src, bufferCopy.srcOffset, chunk, true, false);
+            commandBuffer.end();
+            slice.serial = slice.queue->submit(commandBuffer, 1, &copied);
+        } else {
+            CommandBuffer &commandBuffer = *slice.commandBuffer;
+            commandBuffer.begin();
+
+            // wait for the writes of the commands submitted before
+            VkMemoryBarrier writeBarrier = {VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+            writeBarrier.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+            writeBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                 0, 1, &writeBarrier, 0, nullptr, 0, nullptr);
+            Profiler::Query query;
+            if (context->profiler) query = context->profiler->begin(commandBuffer);
+            vkCmdCopyBuffer(commandBuffer, src, *ring, 1, &bufferCopy);
+            if (context->profiler) context->profiler->end(commandBuffer, query, "download");
+
+            // and keep the commands submitted afterwards from
+            // overwriting src before it has been read
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                 VK_PIPELINE_STAGE_HOST_BIT | VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0,
+                                 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+            commandBuffer.end();
+            slice.serial = slice.queue->submit(commandBuffer);
+            if (context->profiler) context->profiler->submitted(commandBuffer, slice.queue, slice.serial);
+        }
+        inFlight.push_back(slice);
+        done += chunk;
+    }
+    if (inFlight.empty()) return Event();
+    return Event(inFlight.back().queue, inFlight.back().serial, this, inFlight.back().sequence);
+}
+
+// A transfer is complete once all its slices, which are the oldest ones
+// in flight up to sequence, have been retired.
+bool StagingRing::isComplete(uint64_t sequence) {
+    std::lock_guard<std::mutex> lock(mutex);
+    retire(false);
+    return inFlight.empty() || inFlight.front().sequence > sequence;
+}
+
+void StagingRing::wait(uint64_t sequence) {
+    std::lock_guard<std::mutex> lock(mutex);
+    while (!inFlight.empty() && inFlight.front().sequence <= sequence) retire(true);
+}
+
+void StagingRing::wait() {
+    std::lock_guard<std::mutex> lock(mutex);
+    while (!inFlight.empty()) retire(true);
+}
+
+void StagingRing::destroy() {
+    while (!inFlight.empty()) retire(true);
+    for (auto &slice : freeSlices) {
+        slice.commandBuffer->destroy();
+        delete slice.commandBuffer;
+        if (slice.transfer) {
+            slice.transfer->destroy();
+            slice.release->destroy();
+            delete slice.transfer;
+            delete slice.release;
+        }
+    }
+    freeSlices.clear();
+    ring->destroy();
+    delete ring;
+}
+
+Job::Job(Device &device) : Device(device) {
+    // a job slot is recorded by whichever thread begins it
+    upload = new CommandBuffer(device, computeQueueFamily);
+    compute = new CommandBuffer(device, computeQueueFamily);
+    download = new CommandBuffer(device, computeQueueFamily);
+    VkSemaphoreCreateInfo semaphoreCreateInfo = {VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO};
+    if (VK_SUCCESS != vkCreateSemaphore(context->device, &semaphoreCreateInfo, nullptr, &uploadDone) ||
+        VK_SUCCESS != vkCreateSemaphore(context->device, &semaphoreCreateInfo, nullptr, &computeDone)) {
+        throw VKRTL_ERROR_SUBMIT_QUEUE;
+    }
+}
+
+// Take byteSize bytes of the staging memory of the job. When it is too
+// small, a larger buffer replaces it; the copies already recorded keep
+// using the old one, which is released when the job is reused.
+VkDeviceSize Job::reserve(VkDeviceSize byteSize) {
+    VkDeviceSize offset = alignUp(stagingUsed, 16);
+    if (staging == nullptr || offset + byteSize > staging->getSize()) {
+        VkDeviceSize size = staging ? staging->getSize() * 2 : 64 * 1024;
+        while (size < byteSize) size *= 2;
+        if (staging) outgrownStaging.push_back(staging);
+        staging = new Buffer(*this, size, true);
+        offset = 0;
+    }
+    stagingUsed = offset + byteSize;
+    return offset;
+}
+
+void Job::reset() {
+    for (auto buffer : outgrownStaging) {
+        buffer->destroy();
+        delete buffer;
+    }
+    outgrownStaging.clear();
+    stagingUsed = 0;
+    downloads.clear();
+    hasUploads = false;
+    hasDownloads = false;
+    upload->begin();
+    compute->begin();
+    download->begin();
+}
+
+// copy the downloads to the host, once the job has completed
+void Job::retire() {
+    if (retired) return;
+    for (auto &transfer : downloads) {
+        context->allocator->invalidate(transfer.staging->allocation, transfer.offset, transfer.size);
+        memcpy(transfer.hostPtr, (char *)transfer.staging->allocation.mapped + transfer.offset, transfer.size);
+    }
+    retired = true;
+}
+
+void Job::offload(Buffer &buffer, const void *hostPtr) {
+    VkDeviceSize offset = reserve(buffer.getSize());
+    memcpy((char *)staging->allocation.mapped + offset, hostPtr, buffer.getSize());
+    context->allocator->flush(staging->allocation, offset, buffer.getSize());
+    VkBufferCopy bufferCopy = {offset, 0, buffer.getSize()};
+    Profiler::Query query;
+    if (context->profiler) query = context->profiler->begin(*upload);
+    vkCmdCopyBuffer(*upload, *staging, buffer, 1, &bufferCopy);
+    if (context->profiler) context->profiler->end(*upload, query, "upload");
+    hasUploads = true;
+}
+
+void Job::inload(Buffer &buffer, void *hostPtr) {
+    VkDeviceSize offset = reserve(buffer.getSize());
+    VkBufferCopy bufferCopy = {0, offset, buffer.getSize()};
+    Profiler::Query query;
+    if (context->profiler) query = context->profiler->begin(*download);
+    vkCmdCopyBuffer(*download, buffer, *staging, 1, &bufferCopy);
+    if (context->profiler) context->profiler->end(*download, query, "download");
+    downloads.push_back({staging, hostPtr, offset, buffer.getSize()});
+    hasDownloads = true;
+}
+
+CommandBuffer &Job::getCommandBuffer() {
+    return *compute;
+}
+
+bool Job::poll() {
+    if (!done.poll()) return false;
+    retire();
+    return true;
+}
+
+void Job::wait() {
+    TraceSpan span(context->profiler, "Job::wait");
+    done.wait();
+    retire();
+}
+
+void Job::destroy() {
+    wait();
+    for (auto buffer : outgrownStaging) {
+        buffer->destroy();
+        delete buffer;
+    }
+    if (staging) {
+        staging->destroy();
+        delete staging;
+    }
+    upload->destroy();
+    compute->destroy();
+    download->destroy();
+    delete upload;
+    delete compute;
+    delete download;
+    vkDestroySemaphore(context->device, uploadDone, nullptr);
+    vkDestroySemaphore(context->device, computeDone, nullptr);
+}
+
+Scheduler::Scheduler(Device &device, uint32_t inFlight) : Device(device) {
+    for (uint32_t i = 0; i < std::max(inFlight, 1u); i++) {
+        jobs.push_back(new Job(device));
+    }
+}
+
+Job &Scheduler::begin() {
+    // the slot of the job submitted inFlight jobs ago
+    Job &job = *jobs[next++ % jobs.size()];
+    job.wait();
+    job.reset();
+    return job;
+}
+
+Event Scheduler::submit(Job &job) {
+    TraceSpan span(context->profiler, "Scheduler::submit");
+    CommandBuffer *stages[3] = {job.upload, job.compute, job.download};
+    bool recorded[3] = {job.hasUploads, true, job.hasDownloads};
+    VkSemaphore binarySemaphores[3] = {job.uploadDone, job.computeDone, VK_NULL_HANDLE};
+    VkPipelineStageFlags waitStages[3] = {0, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT};
+
+    if (job.hasDownloads) {
+        // make the downloads visible to the host
+        VkMemoryBarrier memoryBarrier = {VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+        memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        memoryBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+        vkCmdPipelineBarrier(*job.download, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
+                             1, &memoryBarrier, 0, nullptr, 0, nullptr);
+    }
+
+    // Each batch waits for the one before it: on the timeline semaphore of
+    // the queue at the serial of that batch, or on a binary semaphore.
+    Queue *queue = queues->select();
+    VkSemaphore timeline = queue->getSemaphore();
+    SemaphoreOperation previous = {VK_NULL_HANDLE, 0, 0};
+    uint64_t serial = 0;
+    for (int i = 0; i < 3; i++) {
+        stages[i]->end();
+        if (!recorded[i]) continue;
+        bool hasNext = i < 2 && (i == 0 || recorded[2]);
+        SemaphoreOperation signal = {binarySemaphores[i], 0, 0};
+        previous.stageMask = waitStages[i];
+        serial = queue->submit(*stages[i], previous.semaphore ? 1 : 0, &previous,
+                               hasNext && !timeline ? 1 : 0, &signal);
+        if (context->profiler) context->profiler->submitted(*stages[i], queue, serial);
+        previous.semaphore = timeline ? timeline : binarySemaphores[i];
+        previous.value = serial;
+    }
+    job.done = Event(queue, serial);
+    job.retired = false;
+    return job.done;
+}
+
+void Scheduler::wait() {
+    for (auto job : jobs) job->wait();
+}
+
+void Scheduler::destroy() {
+    for (auto job : jobs) {
+        job->destroy();
+        delete job;
+    }
+    jobs.clear();
+}
+
+bool Event::poll() {
+    if (ring) return ring->isComplete(sequence);
+    return queue == nullptr || queue->isComplete(serial);
+}
+
+void Event::wait() {
+    if (ring) {
+        ring->wait(sequence);
+    } else if (queue) {
+        queue->wait(serial);
+    }
+}
+
+// Reflect the compute entry points of a SPIR-V module. Only the handful of
+// instructions describing resources, types, constants and workgroup sizes
+// are decoded; the resources of an entry point are the variables that the
+// functions it calls, directly or not, load, store or access.
+static void reflectSpirv(const uint32_t *code, size_t wordCount, std::map<std::string, EntryPoint> &entryPoints) {
+    if (wordCount < 5 || code[0] != 0x07230203) return;
+
+    struct Instruction {
+        uint32_t opcode;
+        std::vector<uint32_t> operands;
+    };
+    struct Function {
+        std::vector<uint32_t> uses;
+        std::vector<uint32_t> calls;
+    };
+    struct Entry {
+        std::string name;
+        uint32_t function;
+        std::vector<uint32_t> interface;
+        uint32_t localSize[3];
+        bool hasLocalSize;
+    };
+    std::vector<Entry> entries;
+    std::map<uint32_t, Instruction> definitions;
+    std::map<uint32_t, std::map<uint32_t, uint32_t>> decorations;
+    std::map<uint32_t, std::map<uint32_t, uint32_t>> memberOffsets;
+    std::map<uint32_t, Function> functions;
+    std::vector<uint32_t> variables;
+    uint32_t workgroupSize = 0;
+    Function *function = nullptr;
+
+    for (size_t i = 5; i < wordCount;) {
+        uint32_t opcode = code[i] & 0xffff;
+        uint32_t length = code[i] >> 16;
+        if (length == 0 || i + length > wordCount) return;
+        const uint32_t *w = code + i;
+        switch (opcode) {
+        case 15: // OpEntryPoint
+            if (w[1] == 5) { // GLCompute
+                Entry entry;
+                entry.name = (const char *)(w + 3);
+                entry.function = w[2];
+                for (uint32_t k = 3 + (uint32_t)entry.name.size() / 4 + 1; k < length; k++)
+                    entry.interface.push_back(w[k]);
+                entry.hasLocalSize = false;
+                entries.push_back(entry);
+            }
+            break;
+        case 16: // OpExecutionMode
+            if (w[2] == 17) { // LocalSize
+                for (auto &entry : entries) {
+                    if (entry.function != w[1]) continue;
+                    for (int d = 0; d < 3; d++) entry.localSize[d] = w[3 + d];
+                    entry.hasLocalSize = true;
+                }
+            }
+            break;
+        case 71: // OpDecorate
+            if (length >= 3) decorations[w[1]][w[2]] = length > 3 ? w[3] : 0;
+            if (length >= 4 && w[2] == 11 && w[3] == 25) workgroupSize = w[1]; // BuiltIn WorkgroupSize
+            break;
+        case 72: // OpMemberDecorate
+            if (length >= 5 && w[3] == 35) memberOffsets[w[1]][w[2]] = w[4]; // Offset
+            break;
+        case 21: case 22: case 23: case 24: case 25: case 26: case 27: // OpType*
+        case 28: case 29: case 30: case 32:
+            definitions[w[1]] = {opcode, std::vector<uint32_t>(w + 2, w + length)};
+            break;
+        case 43: case 44: case 50: case 51: // OpConstant*, OpSpecConstant*
+            definitions[w[2]] = {opcode, std::vector<uint32_t>(w + 3, w + length)};
+            break;
+        case 59: // OpVariable
+            definitions[w[2]] = {opcode, std::vector<uint32_t>(w + 1, w + length)};
+            if (function == nullptr) variables.push_back(w[2]);
+            break;
+        case 54: // OpFunction
+            function = &functions[w[2]];
+            break;
+        case 56: // OpFunctionEnd
+            function = nullptr;
+            break;
+        case 57: // OpFunctionCall
+            if (function) {
+                function->calls.push_back(w[3]);
+                for (uint32_t k = 4; k < length; k++) function->uses.push_back(w[k]);
+            }
+            break;
+        case 61: case 65: case 66: case 67: case 68: case 60: // OpLoad, OpAccessChain..., OpArrayLength, OpImageTexelPointer
+            if (function && length > 3) function->uses.push_back(w[3]);
+            break;
+        case 62: // OpStore
+            if (function) function->uses.push_back(w[1]);
+            break;
+        case 63: // OpCopyMemory
+            if (function) {
+                function->uses.push_back(w[1]);
+                function->uses.push_back(w[2]);
+            }
+            break;
+        default:
+            if (opcode >= 227 && opcode <= 242 && function && length > 3) { // OpAtomic*
+                function->uses.push_back(opcode == 228 ? w[1] : w[3]); // OpAtomicStore has no result
+            }
+            break;
+        }
+        i += length;
+    }
+
+    auto constant = [&](uint32_t id, uint32_t fallback) -> uint32_t {
+        auto it = definitions.find(id);
+        if (it == definitions.end() || (it->second.opcode != 43 && it->second.opcode != 50)) return fallback;
+        return it->second.operands.empty() ? fallback : it->second.operands[0];
+    };
+    std::function<uint32_t(uint32_t)> sizeOf = [&](uint32_t type) -> uint32_t {
+        auto it = definitions.find(type);
+        if (it == definitions.end()) return 0;
+        std::vector<uint32_t> &ops = it->second.operands;
+        switch (it->second.opcode) {
+        case 21: case 22: return ops[0] / 8;
+        case 23: case 24: return ops[1] * sizeOf(ops[0]);
+        case 28: {
+            auto stride = decorations[type].find(6); // ArrayStride
+            uint32_t elementSize = stride != decorations[type].end() ? stride->second : sizeOf(ops[0]);
+            return constant(ops[1], 0) * elementSize;
+        }
+        case 30: {
+            uint32_t size = 0, offset = 0;
+            for (uint32_t m = 0; m < ops.size(); m++) {
+                auto member = memberOffsets[type].find(m);
+                if (member != memberOffsets[type].end()) offset = member->second;
+                offset += sizeOf(ops[m]);
+                size = std::max(size, offset);
+            }
+            return size;
+        }
+        default: return 0;
+        }
+    };
+
+    for (auto &entry : entries) {
+        // every variable the entry point can reach
+        std::vector<uint32_t> used = entry.interface;
+        std::vector<uint32_t> pendingFunctions(1, entry.function);
+        std::vector<uint32_t> visited;
+        while (!pendingFunctions.empty()) {
+            uint32_t id = pendingFunctions.back();
+            pendingFunctions.pop_back();
+            if (std::find(visited.begin(), visited.end(), id) != visited.end()) continue;
+            visited.push_back(id);
+            Function &callee = functions[id];
+            used.insert(used.end(), callee.uses.begin(), callee.uses.end());
+            pendingFunctions.insert(pendingFunctions.end(), callee.calls.begin(), callee.calls.end());
+        }
+
+        EntryPoint entryPoint;
+        entryPoint.pushConstantSize = 0;
+        for (auto variable : variables) {
+            if (std::find(used.begin(), used.end(), variable) == used.end()) continue;
+            std::vector<uint32_t> &ops = definitions[variable].operands;
+            uint32_t storageClass = ops[2];
+            Instruction &pointer = definitions[ops[0]];
+            uint32_t type = pointer.operands.size() > 1 ? pointer.operands[1] : 0;
+
+            if (storageClass == 9) { // PushConstant
+                entryPoint.pushConstantSize = sizeOf(type);
+                continue;
+            }
+            if (storageClass != 0 && storageClass != 2 && storageClass != 12) continue;
+
+            VkDescriptorSetLayoutBinding binding = {};
+            binding.binding = decorations[variable][33];
+            binding.descriptorCount = 1;
+            binding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+            if (decorations[variable][34] != 0) throw VKRTL_ERROR_SHADER;
+            if (definitions[type].opcode == 28) {
+                binding.descriptorCount = constant(definitions[type].operands[1], 1);
+                type = definitions[type].operands[0];
+            }
+            Instruction &resource = definitions[type];
+            if (storageClass == 12) {
+                binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            } else if (storageClass == 2) {
+                bool bufferBlock = decorations[type].count(3) != 0;
+                binding.descriptorType = bufferBlock ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER
+                                                     : VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+            } else if (resource.opcode == 25) { // OpTypeImage: Dim, ..., Sampled
+                bool storage = resource.operands[5] == 2;
+                if (resource.operands[1] == 5) {
+                    binding.descriptorType = storage ? VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER
+                                                     : VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
+                } else {
+                    binding.descriptorType = storage ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE
+                                                     : VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+                }
+            } else if (resource.opcode == 26) {
+                binding.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER;
+            } else if (resource.opcode == 27) {
+                binding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+            } else {
+                continue;
+            }
+            entryPoint.bindings.push_back(binding);
+        }
+        std::sort(entryPoint.bindings.begin(), entryPoint.bindings.end(),
+                  [](const VkDescriptorSetLayoutBinding &a, const VkDescriptorSetLayoutBinding &b) {
+                      return a.binding < b.binding;
+                  });
+
+        // the WorkgroupSize built-in takes precedence over the LocalSize mode
+        for (int d = 0; d < 3; d++) {
+            entryPoint.localSize[d] = entry.hasLocalSize ? entry.localSize[d] : 1;
+            entryPoint.localSizeSpecId[d] = -1;
+        }
+        auto composite = definitions.find(workgroupSize);
+        if (workgroupSize && composite != definitions.end() && composite->second.operands.size() >= 3) {
+            for (int d = 0; d < 3; d++) {
+                uint32_t component = composite->second.operands[d];
+                entryPoint.localSize[d] = constant(component, 1);
+                if (definitions[component].opcode == 50 && decorations[component].count(1)) // SpecId
+                    entryPoint.localSizeSpecId[d] = decorations[component][1];
+            }
+        }
+        entryPoints[entry.name] = entryPoint;
+    }
+}
+
+void Program::sharedConstructor(Device &device, const uint32_t *code, size_t byteSize) {
+    module = std::make_shared<Module>();
+    module->context = device.getContext();
+    VkShaderModuleCreateInfo shaderModuleCreateInfo = {VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO};
+    shaderModuleCreateInfo.codeSize = byteSize;
+    shaderModuleCreateInfo.pCode = code;
+    if (VK_SUCCESS != vkCreateShaderModule(module->context->device, &shaderModuleCreateInfo, nullptr,
+                                           &module->shaderModule)) {
+        throw VKRTL_ERROR_SHADER;
+    }
+    reflectSpirv(code, byteSize / 4, module->entryPoints);
+}
+
+Program::Program(Device &device, const char *fileName) {
+    TraceSpan span(device.getContext()->profiler, "Program::Program");
+    std::vector<uint32_t> code;
+    size_t byteLength;
+    {
+        TraceSpan read(device.getContext()->profiler, "read SPIR-V");
+        std::ifstream fin(fileName, std::ifstream::ate | std::ifstream::binary);
+        byteLength = fin.tellg();
+        fin.seekg(0, std::ifstream::beg);
+        code.resize(byteLength / 4);
+        fin.read((char *)code.data(), byteLength);
+        fin.close();
+    }
+    sharedConstructor(device, code.data(), byteLength);
+}
+
+// The size of the code is unknown here, prefer the constructor taking it:
+// without it the module cannot be reflected.
+Program::Program(Device &device, uint32_t *data) {
+    TraceSpan span(device.getContext()->profiler, "Program::Program");
+    sharedConstructor(device, data, sizeof(data));
+}
+
+Program::Program(Device &device, const uint32_t *data, size_t byteSize) {
+    TraceSpan span(device.getContext()->profiler, "Program::Program");
+    sharedConstructor(device, data, byteSize);
+}
+
+const EntryPoint *Program::getEntryPoint(const char *name) {
+    auto it = module->entryPoints.find(name);
+    return it == module->entryPoints.end() ? nullptr : &it->second;
+}
+
+// Once the device is destroyed, the module and pipelines are gone with it.
+Program::Module::~Module() {
+    if (context->destroyed) return;
+    for (auto &entry : pipelines) vkDestroyPipeline(context->device, entry.second, nullptr);
+    vkDestroyShaderModule(context->device, shaderModule, nullptr);
+    if (_verbose)
+        std::cout << "[vkrtl] destroy the Program." << std::endl;
+}
+
+// The module stays alive as long as kernels of the program do.
+void Program::destroy() {
+    module.reset();
+}
+
+
+// A constant set again keeps its entry and takes the new value.
+Specialization &Specialization::set(uint32_t constantID, const void *value, size_t byteSize) {
+    for (auto &entry : entries) {
+        if (entry.constantID == constantID && entry.size == byteSize) {
+            memcpy(data.data() + entry.offset, value, byteSize);
+            return *this;
+        }
+    }
+    VkSpecializationMapEntry entry = {constantID, (uint32_t)data.size(), byteSize};
+    entries.push_back(entry);
+    data.insert(data.end(), (const uint8_t *)value, (const uint8_t *)value + byteSize);
+    return *this;
+}
+
+Specialization::operator const VkSpecializationInfo *() {
+    if (entries.empty()) return nullptr;
+    info.mapEntryCount = entries.size();
+    info.pMapEntries = entries.data();
+    info.dataSize = data.size();
+    info.pData = data.data();
+    return &info;
+}
+
+// bindings 0, 1, ... of the given types, one descriptor each
+std::vector<VkDescriptorSetLayoutBinding> Kernel::toBindings(std::vector<ResourceType> &resourceTypes) {
+    std::vector<VkDescriptorSetLayoutBinding> bindings(resourceTypes.size());
+    for (uint32_t i = 0; i < resourceTypes.size(); i++) {
+        bindings[i].binding = i;
+        bindings[i].descriptorType = (VkDescriptorType)resourceTypes[i];
+        bindings[i].descriptorCount = 1;
+        bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        bindings[i].pImmutableSamplers = nullptr;
+    }
+    return bindings;
+}
+
+Kernel::Kernel(Device &device, Program &program, const char *kernelName,
+       const VkSpecializationInfo *specializationInfo, BindingMode bindingMode)
+    : context(device.getContext()), module(program.module) {
+    const EntryPoint *entryPoint = program.getEntryPoint(kernelName);
+    if (entryPoint == nullptr) {
+        throw VKRTL_ERROR_SHADER;
+    }
+    sharedConstructor(kernelName, entryPoint->bindings, entryPoint->pushConstantSize, specializationInfo,
+                      bindingMode);
+}
+
+Kernel::Kernel(Device &device, Program &program, const char *kernelName,
+       std::vector<ResourceType> resourceTypes, uint32_t pushConstantSize,
+       const VkSpecializationInfo *specializationInfo, BindingMode bindingMode)
+    : context(device.getContext()), module(program.module) {
+    sharedConstructor(kernelName, toBindings(resourceTypes), pushConstantSize, specializationInfo, bindingMode);
+}
+
+Kernel::Kernel(Device &device, Program &program, const char *kernelName,
+       VkCommandBuffer commandBuffer, std::vector<ResourceType> resourceTypes,
+       uint32_t pushConstantSize, const VkSpecializationInfo *specializationInfo)
+    : context(device.getContext()), module(program.module) {
+    sharedConstructor(kernelName, toBindings(resourceTypes), pushConstantSize, specializationInfo);
+    bindTo(commandBuffer);
+}
+
+void Kernel::sharedConstructor(const char *kernelName, std::vector<VkDescriptorSetLayoutBinding> bindings,
+                               uint32_t pushConstantSize, const VkSpecializationInfo *specializationInfo,
+                               BindingMode bindingMode) {
+    TraceSpan span(context->profiler, "Kernel::Kernel");
+    layout = std::make_shared<Layout>();
+    layout->context = context;
+    layout->kernelName = kernelName;
+    layout->bindings = bindings;
+    layout->pushConstantSize = pushConstantSize;
+    uint32_t *localSize = layout->localSize;
+
+    // the workgroup size of the entry point, as specialized
+    auto found = module->entryPoints.find(kernelName);
+    const EntryPoint *entryPoint = found == module->entryPoints.end() ? nullptr : &found->second;
+    for (int d = 0; entryPoint && d < 3; d++) {
+        localSize[d] = entryPoint->localSize[d];
+        for (uint32_t i = 0; specializationInfo && i < specializationInfo->mapEntryCount; i++) {
+            const VkSpecializationMapEntry &entry = specializationInfo->pMapEntries[i];
+            if ((int32_t)entry.constantID == entryPoint->localSizeSpecId[d] && entry.size == sizeof(uint32_t)) {
+                memcpy(&localSize[d], (const char *)specializationInfo->pData + entry.offset, sizeof(uint32_t));
+            }
+        }
+    }
+
+    // Arguments only bind buffers: a kernel using images, samplers or
+    // texel buffers could never be given its resources
+    for (auto &binding : bindings) {
+        if (binding.descriptorType != VK_DESCRIPTOR_TYPE_STORAGE_BUFFER &&
+            binding.descriptorType != VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
+            throw VKRTL_ERROR_SHADER;
+        }
+    }
+
+    // the push-constant range must be a multiple of 4 bytes and fit
+    // in the space the device guarantees for push constants
+    if (pushConstantSize % 4 != 0 || pushConstantSize > context->physicalDeviceProperties.limits.maxPushConstantsSize) {
+        throw VKRTL_ERROR_SHADER;
+    }
+
+    VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO};
+    descriptorSetLayoutCreateInfo.pBindings = bindings.data();
+    descriptorSetLayoutCreateInfo.bindingCount = bindings.size();
+
+    // 32 descriptors is the least maxPushDescriptors of any device
+    uint32_t descriptorCount = 0;
+    for (auto &binding : bindings) descriptorCount += binding.descriptorCount;
+    if (bindingMode == PUSH_DESCRIPTORS && context->vkCmdPushDescriptorSet && descriptorCount <= 32) {
+        descriptorSetLayoutCreateInfo.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR;
+        layout->pushDescriptorLayout = true;
+    } else if (bindingMode == PUSH_DESCRIPTORS && _verbose) {
+        std::cout << "[vkrtl] push descriptors are not available for " << kernelName << std::endl;
+    }
+    if (VK_SUCCESS !=
+        vkCreateDescriptorSetLayout(context->device, &descriptorSetLayoutCreateInfo, nullptr,
+                                    &layout->descriptorSetLayout)) {
+        throw VKRTL_ERROR_SHADER;
+    }
+
+    VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = {VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO};
+    pipelineLayoutCreateInfo.setLayoutCount = 1;
+    pipelineLayoutCreateInfo.pSetLayouts = &layout->descriptorSetLayout;
+    VkPushConstantRange pushConstantRange = {VK_SHADER_STAGE_COMPUTE_BIT, 0, pushConstantSize};
+    if (pushConstantSize > 0) {
+        pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
+        pipelineLayoutCreateInfo.pPushConstantRanges = &pushConstantRange;
+    }
+    if (VK_SUCCESS !=
+        vkCreatePipelineLayout(context->device, &pipelineLayoutCreateInfo, nullptr, &layout->pipelineLayout)) {
+        throw VKRTL_ERROR_SHADER;
+    }
+
+    // one template entry per binding, reading its descriptors from an
+    // array of VkDescriptorBufferInfo in the order of the bindings
+    if (context->vkCreateDescriptorUpdateTemplate && !layout->pushDescriptorLayout && !bindings.empty()) {
+        std::vector<VkDescriptorUpdateTemplateEntry> entries(bindings.size());
+        for (uint32_t i = 0, first = 0; i < bindings.size(); i++) {
+            entries[i].dstBinding = bindings[i].binding;
+            entries[i].dstArrayElement = 0;
+            entries[i].descriptorCount = bindings[i].descriptorCount;
+            entries[i].descriptorType = bindings[i].descriptorType;
+            entries[i].offset = first * sizeof(VkDescriptorBufferInfo);
+            entries[i].stride = sizeof(VkDescriptorBufferInfo);
+            first += bindings[i].descriptorCount;
+        }
+        VkDescriptorUpdateTemplateCreateInfo templateCreateInfo = {
+            VK_STRUCTURE_TYPE_DESCRIPTOR_UPDATE_TEMPLATE_CREATE_INFO};
+        templateCreateInfo.descriptorUpdateEntryCount = entries.size();
+        templateCreateInfo.pDescriptorUpdateEntries = entries.data();
+        templateCreateInfo.templateType = VK_DESCRIPTOR_UPDATE_TEMPLATE_TYPE_DESCRIPTOR_SET;
+        templateCreateInfo.descriptorSetLayout = layout->descriptorSetLayout;
+        if (VK_SUCCESS != context->vkCreateDescriptorUpdateTemplate(context->device, &templateCreateInfo, nullptr,
+                                                                    &layout->updateTemplate)) {
+            throw VKRTL_ERROR_DESCRIPTOR;
+        }
+    }
+
+    VkPipelineShaderStageCreateInfo pipelineShaderInfo = {VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO};
+    pipelineShaderInfo.module = module->shaderModule;
+    pipelineShaderInfo.pName = kernelName;
+    pipelineShaderInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineShaderInfo.pSpecializationInfo = specializationInfo;
+
+    // Kernels with the same entry point, interface and specialization
+    // share one pipeline; the layouts they are created with are compatible.
+    std::string key = layout->kernelName;
+    key.push_back('\0');
+    for (auto &binding : bindings) {
+        key.append((const char *)&binding.binding, sizeof(binding.binding));
+        key.append((const char *)&binding.descriptorType, sizeof(binding.descriptorType));
+        key.append((const char *)&binding.descriptorCount, sizeof(binding.descriptorCount));
+    }
+    key.append((const char *)&pushConstantSize, sizeof(pushConstantSize));
+    key.push_back(layout->pushDescriptorLayout ? 'p' : 's');
+    if (specializationInfo) {
+        key.append((const char *)specializationInfo->pMapEntries,
+                   specializationInfo->mapEntryCount * sizeof(VkSpecializationMapEntry));
+        key.append((const char *)specializationInfo->pData, specializationInfo->dataSize);
+    }
+    std::lock_guard<std::mutex> lock(module->mutex);
+    auto it = module->pipelines.find(key);
+    if (it != module->pipelines.end()) {
+        pipeline = it->second;
+        return;
+    }
+
+    VkComputePipelineCreateInfo pipelineInfo = {VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO};
+    pipelineInfo.stage = pipelineShaderInfo;
+    pipelineInfo.layout = layout->pipelineLayout;
+    if (context->vkCmdDispatchBase) pipelineInfo.flags = VK_PIPELINE_CREATE_DISPATCH_BASE_BIT;
+    TraceSpan create(context->profiler, "vkCreateComputePipelines");
+    if (VK_SUCCESS !=
+        vkCreateComputePipelines(context->device, context->pipelineCache, 1, &pipelineInfo, nullptr, &pipeline)) {
+        throw VKRTL_ERROR_PIPELINE;
+    }
+    module->pipelines[key] = pipeline;
+}
+
+void Kernel::Layout::getWrites(VkDescriptorSet descriptorSet, const VkDescriptorBufferInfo *bufferInfos,
+                       std::vector<VkWriteDescriptorSet> &writes) {
+    writes.resize(bindings.size());
+    for (uint32_t i = 0, first = 0; i < bindings.size(); i++) {
+        VkWriteDescriptorSet &writeDescriptorSet = writes[i];
+        writeDescriptorSet = {VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET};
+        writeDescriptorSet.dstSet = descriptorSet;
+        writeDescriptorSet.dstBinding = bindings[i].binding;
+        writeDescriptorSet.descriptorCount = bindings[i].descriptorCount;
+        writeDescriptorSet.descriptorType = bindings[i].descriptorType;
+        writeDescriptorSet.pBufferInfo = bufferInfos + first;
+        first += bindings[i].descriptorCount;
+    }
+}
+
+void Kernel::pushArguments(VkCommandBuffer commandBuffer, BufferList &resources) {
+    uint32_t descriptorCount = 0;
+    for (auto &binding : layout->bindings) descriptorCount += binding.descriptorCount;
+    if (descriptorCount != resources.size()) {
+        throw VKRTL_ERROR_DESCRIPTOR;
+    }
+    std::vector<VkDescriptorBufferInfo> bufferInfos(resources.size());
+    for (uint32_t i = 0; i < resources.size(); i++) {
+        bufferInfos[i] = {resources[i].get(), 0, VK_WHOLE_SIZE};
+    }
+    std::vector<VkWriteDescriptorSet> writes;
+    if (layout->pushDescriptorLayout) {
+        // the descriptors are recorded in the command buffer itself
+        layout->getWrites(VK_NULL_HANDLE, bufferInfos.data(), writes);
+        context->vkCmdPushDescriptorSet(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, layout->pipelineLayout, 0,
+                                        writes.size(), writes.data());
+        return;
+    }
+    VkDescriptorSet descriptorSet = context->descriptors->allocateTransient(layout->descriptorSetLayout);
+    layout->getWrites(descriptorSet, bufferInfos.data(), writes);
+    vkUpdateDescriptorSets(context->device, writes.size(), writes.data(), 0, nullptr);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, layout->pipelineLayout, 0, 1,
+                            &descriptorSet, 0, nullptr);
+}
+
+BindingMode Kernel::getBindingMode() {
+    return layout->pushDescriptorLayout ? PUSH_DESCRIPTORS : DESCRIPTOR_SETS;
+}
+
+void Kernel::bindTo(VkCommandBuffer commandBuffer) {
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+    if (context->profiler) context->profiler->bind(commandBuffer, layout->kernelName);
+}
+
+const uint32_t *Kernel::getLocalSize() {
+    return layout->localSize;
+}
+
+void Kernel::getGroupCount(uint32_t globalX, uint32_t globalY, uint32_t globalZ, uint32_t groupCount[3]) {
+    uint32_t globalSize[3] = {globalX, globalY, globalZ};
+    for (int d = 0; d < 3; d++) groupCount[d] = (globalSize[d] + layout->localSize[d] - 1) / layout->localSize[d];
+}
+
+void Kernel::pushConstants(VkCommandBuffer commandBuffer, const void *data, uint32_t byteSize, uint32_t offset) {
+    if (offset % 4 != 0 || byteSize % 4 != 0 || offset + byteSize > layout->pushConstantSize) {
+        throw VKRTL_ERROR_COMMAND_BUFFER;
+    }
+    vkCmdPushConstants(commandBuffer, layout->pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, offset, byteSize, data);
+}
+
+// The layout goes away with the last Arguments of the kernel, whose sets
+// are given back first; once the device is destroyed, it is gone with it.
+Kernel::Layout::~Layout() {
+    if (context->destroyed) return;
+    if (updateTemplate) context->vkDestroyDescriptorUpdateTemplate(context->device, updateTemplate, nullptr);
+    context->descriptorCache->forget(descriptorSetLayout);
+    context->descriptors->forget(descriptorSetLayout);
+    vkDestroyDescriptorSetLayout(context->device, descriptorSetLayout, nullptr);
+    vkDestroyPipelineLayout(context->device, pipelineLayout, nullptr);
     if (_verbose)
         std::cout << "[vkrtl] destroy the Kernel." << std::endl;
 }
 
-Arguments::Arguments(Kernel &kernel, std::vector<Buffer> resources) : Kernel(kernel) {
+void Kernel::destroy() {
+    layout.reset();
+    module.reset();
+}
+
+Arguments::Arguments(Kernel &kernel, BufferList resources, bool transient)
+    : context(kernel.context), layout(kernel.layout), transient(transient) {
     sharedConstructor(resources);
 }
 
-Arguments::Arguments(Kernel &kernel, VkCommandBuffer commandBuffer, std::vector<Buffer> resources) : Kernel(kernel) {
+Arguments::Arguments(Kernel &kernel, VkCommandBuffer commandBuffer, BufferList resources, bool transient)
+    : context(kernel.context), layout(kernel.layout), transient(transient) {
     sharedConstructor(resources);
     bindTo(commandBuffer);
 }
 
-void Arguments::sharedConstructor(std::vector<Buffer> resources) {
-
-    VkDescriptorPoolSize descriptorPoolSizes[] = {{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, (uint32_t)resources.size()}};
+Arguments::Arguments(Arguments &&other)
+    : context(std::move(other.context)), layout(std::move(other.layout)), descriptorSet(other.descriptorSet),
+      transient(other.transient), owned(other.owned) {
+    other.descriptorSet = VK_NULL_HANDLE;
+}
 
-    VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = {VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO};
-    descriptorPoolCreateInfo.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
-    descriptorPoolCreateInfo.poolSizeCount = 1;
-    descriptorPoolCreateInfo.maxSets = 1;
-    descriptorPoolCreateInfo.pPoolSizes = descriptorPoolSizes;
-    if (VK_SUCCESS != vkCreateDescriptorPool(device, &descriptorPoolCreateInfo, nullptr, &descriptorPool)) {
-        throw VKRTL_ERROR_DESCRIPTOR;
+Arguments &Arguments::operator=(Arguments &&other) {
+    if (this != &other) {
+        if (descriptorSet != VK_NULL_HANDLE && !context->destroyed) destroy();
+        context = std::move(other.context);
+        layout = std::move(other.layout);
+        descriptorSet = other.descriptorSet;
+        transient = other.transient;
+        owned = other.owned;
+        other.descriptorSet = VK_NULL_HANDLE;
     }
+    return *this;
+}
 
-    // allocate the descriptor set (according to the function's layout)
-    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo = {VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO};
-    descriptorSetAllocateInfo.descriptorSetCount = 1;
-    descriptorSetAllocateInfo.pSetLayouts = &descriptorSetLayout;
-    descriptorSetAllocateInfo.descriptorPool = descriptorPool;
+// Once the device is destroyed, the sets are gone with it.
+Arguments::~Arguments() {
+    if (descriptorSet != VK_NULL_HANDLE && !context->destroyed) destroy();
+}
 
-    if (VK_SUCCESS != vkAllocateDescriptorSets(device, &descriptorSetAllocateInfo, &descriptorSet)) {
+void Arguments::sharedConstructor(BufferList &resources) {
+    TraceSpan span(context->profiler, "Arguments::Arguments");
+
+    // the buffers fill the bindings of the kernel in order; push
+    // descriptor layouts have no sets
+    uint32_t descriptorCount = 0;
+    for (auto &binding : layout->bindings) descriptorCount += binding.descriptorCount;
+    if (descriptorCount != resources.size() || layout->pushDescriptorLayout) {
         throw VKRTL_ERROR_DESCRIPTOR;
     }
 
     // buffers to bind
-    VkDescriptorBufferInfo *descriptorBufferInfo = new VkDescriptorBufferInfo[resources.size()];
+    std::vector<VkDescriptorBufferInfo> descriptorBufferInfo(resources.size());
     for (uint32_t i = 0; i < resources.size(); i++) {
-        descriptorBufferInfo[i].buffer = resources[i];
+        descriptorBufferInfo[i].buffer = resources[i].get();
         descriptorBufferInfo[i].offset = 0;
         descriptorBufferInfo[i].range = VK_WHOLE_SIZE;
     }
 
     // bind stuff here
-    VkWriteDescriptorSet writeDescriptorSet = {VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET};
-    writeDescriptorSet.dstSet = descriptorSet; // pipeline.getDescriptorSet();
-    writeDescriptorSet.dstBinding = 0;
-    writeDescriptorSet.descriptorCount = resources.size();
-    writeDescriptorSet.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    writeDescriptorSet.pBufferInfo = descriptorBufferInfo;
-    vkUpdateDescriptorSets(device, 1, &writeDescriptorSet, 0, nullptr);
-    delete[] descriptorBufferInfo;
+    auto write = [&](VkDescriptorSet descriptorSet) {
+        this->write(descriptorSet, descriptorBufferInfo.data());
+    };
+
+    // allocate the descriptor set (according to the function's layout),
+    // or share the one already written for the same buffers
+    if (transient) {
+        descriptorSet = context->descriptors->allocateTransient(layout->descriptorSetLayout);
+        write(descriptorSet);
+    } else {
+        descriptorSet = context->descriptorCache->acquire(layout->descriptorSetLayout, descriptorBufferInfo, write);
+    }
+}
+
+void Arguments::write(VkDescriptorSet descriptorSet, const VkDescriptorBufferInfo *bufferInfos) {
+    if (layout->updateTemplate) {
+        TraceSpan update(context->profiler, "vkUpdateDescriptorSetWithTemplate");
+        context->vkUpdateDescriptorSetWithTemplate(context->device, descriptorSet, layout->updateTemplate, bufferInfos);
+        return;
+    }
+    std::vector<VkWriteDescriptorSet> writeDescriptorSets;
+    layout->getWrites(descriptorSet, bufferInfos, writeDescriptorSets);
+    TraceSpan update(context->profiler, "vkUpdateDescriptorSets");
+    vkUpdateDescriptorSets(context->device, writeDescriptorSets.size(), writeDescriptorSets.data(), 0, nullptr);
+}
+
+// A set shared through the cache must not change under the other Arguments
+// using it: the first rebind gives it back and takes a set of its own.
+void Arguments::rebind(const VkDescriptorBufferInfo *bufferInfos) {
+    if (!transient && !owned) {
+        context->descriptorCache->release(descriptorSet);
+        descriptorSet = context->descriptors->allocate(layout->descriptorSetLayout);
+        owned = true;
+    }
+    write(descriptorSet, bufferInfos);
 }
 
 void Arguments::bindTo(VkCommandBuffer commandBuffer) {
-    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayout, 0, 1, &descriptorSet, 0,
-                            nullptr);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, layout->pipelineLayout, 0, 1,
+                            &descriptorSet, 0, nullptr);
 }
 
 void Arguments::destroy() {
-    vkFreeDescriptorSets(device, descriptorPool, 1, &descriptorSet);
-    vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+    if (descriptorSet == VK_NULL_HANDLE) return;
+    if (owned) {
+        context->descriptors->free(layout->descriptorSetLayout, descriptorSet);
+    } else if (!transient) {
+        context->descriptorCache->release(descriptorSet);
+    }
+    descriptorSet = VK_NULL_HANDLE;
+    layout.reset();
     if (_verbose)
         std::cout << "[vkrtl] Destroy arguments." << std::endl;
 }
 
+Capture::Capture(Device &device) : Device(device) {
+    // replays may be submitted from any thread
+    commandBuffer = new CommandBuffer(device, computeQueueFamily);
+}
+
+// Commands are recorded as they are captured, and kept to record the
+// sequence again when a push constant changes.
+void Capture::add(std::function<void(CommandBuffer &)> command) {
+    command(*commandBuffer);
+    commands.push_back(command);
+}
+
+// Each thread submits to a queue of its own, so the replays may complete
+// in any order: all of them are waited for.
+void Capture::waitReplays() {
+    for (auto &event : replays) event.wait();
+    replays.clear();
+}
+
+void Capture::begin() {
+    std::lock_guard<std::mutex> lock(mutex);
+    waitReplays();
+    commands.clear();
+    parameters.clear();
+    commandBuffer->begin(VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT);
+}
+
+// The kernel and arguments are kept by address, like the buffers of copy,
+// so that a sequence recorded again binds the set they hold at that time,
+// e.g. after Arguments::rebind.
+void Capture::dispatch(Kernel &kernel, Arguments &arguments, uint32_t x, uint32_t y, uint32_t z) {
+    Kernel *kernelPtr = &kernel;
+    Arguments *argumentsPtr = &arguments;
+    add([=](CommandBuffer &commandBuffer) {
+        argumentsPtr->bindTo(commandBuffer);
+        kernelPtr->bindTo(commandBuffer);
+        commandBuffer.dispatch(x, y, z);
+    });
+}
+
+void Capture::enqueueNDRange(Kernel &kernel, Arguments &arguments, NDRange globalSize, NDRange localSize) {
+    Kernel *kernelPtr = &kernel;
+    Arguments *argumentsPtr = &arguments;
+    add([=](CommandBuffer &commandBuffer) {
+        commandBuffer.enqueueNDRange(*kernelPtr, *argumentsPtr, globalSize, localSize);
+    });
+}
+
+void Capture::copy(Buffer &src, Buffer &dst, size_t byteSize) {
+    Buffer *srcBuffer = &src, *dstBuffer = &dst;
+    add([=](CommandBuffer &commandBuffer) {
+        srcBuffer->enqueueCopy(*srcBuffer, *dstBuffer, byteSize, commandBuffer);
+    });
+}
+
+void Capture::barrier() {
+    add([](CommandBuffer &commandBuffer) {
+        commandBuffer.barrier();
+    });
+}
+
+void Capture::barrier(BarrierType type, std::vector<BufferRange> ranges) {
+    add([=](CommandBuffer &commandBuffer) {
+        commandBuffer.barrier(type, ranges);
+    });
+}
+
+void Capture::pushConstants(Kernel &kernel, const void *hostPtr, uint32_t byteSize, uint32_t offset) {
+    Parameter parameter = {hostPtr, std::vector<uint8_t>(byteSize)};
+    parameters.push_back(parameter);
+    size_t index = parameters.size() - 1;
+    Kernel *kernelPtr = &kernel;
+    add([=](CommandBuffer &commandBuffer) {
+        // snapshot the value that gets recorded
+        memcpy(parameters[index].recorded.data(), hostPtr, byteSize);
+        commandBuffer.pushConstants(*kernelPtr, hostPtr, byteSize, offset);
+    });
+}
+
+void Capture::end() {
+    commandBuffer->end();
+}
+
+Event Capture::replay() {
+    std::lock_guard<std::mutex> lock(mutex);
+    replays.erase(std::remove_if(replays.begin(), replays.end(), [](Event &event) { return event.poll(); }),
+                  replays.end());
+    bool changed = false;
+    for (auto &parameter : parameters) {
+        if (memcmp(parameter.recorded.data(), parameter.hostPtr, parameter.recorded.size()) != 0) changed = true;
+    }
+    if (changed) {
+        // the command buffer cannot be recorded while a replay is pending
+        waitReplays();
+        commandBuffer->begin(VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT);
+        for (auto &command : commands) command(*commandBuffer);
+        commandBuffer->end();
+    }
+    Event replayed = submit(*commandBuffer);
+    replays.push_back(replayed);
+    return replayed;
+}
+
+void Capture::destroy() {
+    std::lock_guard<std::mutex> lock(mutex);
+    waitReplays();
+    commandBuffer->destroy();
+    delete commandBuffer;
+    commands.clear();
+}
+
+TaskGraph::TaskGraph(Device &device) : Device(device) {
+    commandBuffer = new CommandBuffer(device, computeQueueFamily);
+}
+
+static std::vector<VkBuffer> toHandles(BufferList &buffers) {
+    std::vector<VkBuffer> handles;
+    for (Buffer &buffer : buffers) handles.push_back(buffer);
+    return handles;
+}
+
+// A node goes one level below the deepest node it depends on: the last
+// writer of the buffers it reads, and the last writer and the readers
+// since of the buffers it writes.
+uint32_t TaskGraph::add(Node node) {
+    int32_t level = 0;
+    for (VkBuffer buffer : node.reads) {
+        level = std::max(level, hazards[buffer].writeLevel + 1);
+    }
+    for (VkBuffer buffer : node.writes) {
+        Hazards &hazard = hazards[buffer];
+        level = std::max(level, std::max(hazard.writeLevel, hazard.readLevel) + 1);
+    }
+    for (VkBuffer buffer : node.reads) {
+        Hazards &hazard = hazards[buffer];
+        hazard.readLevel = std::max(hazard.readLevel, level);
+    }
+    for (VkBuffer buffer : node.writes) {
+        Hazards &hazard = hazards[buffer];
+        hazard.writeLevel = level;
+        hazard.readLevel = -1;
+    }
+    node.level = level;
+    levels = std::max(levels, node.level + 1);
+    nodes.push_back(node);
+    return nodes.size() - 1;
+}
+
+uint32_t TaskGraph::dispatch(Kernel &kernel, Arguments &arguments, BufferList reads, BufferList writes,
+                             uint32_t x, uint32_t y, uint32_t z) {
+    Kernel *kernelPtr = &kernel;
+    Arguments *argumentsPtr = &arguments;
+    Node node;
+    node.command = [=](CommandBuffer &commandBuffer) {
+        argumentsPtr->bindTo(commandBuffer);
+        kernelPtr->bindTo(commandBuffer);
+        commandBuffer.dispatch(x, y, z);
+    };
+    node.reads = toHandles(reads);
+    node.writes = toHandles(writes);
+    node.stage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    node.readAccess = VK_ACCESS_SHADER_READ_BIT;
+    node.writeAccess = VK_ACCESS_SHADER_WRITE_BIT;
+    return add(node);
+}
+
+uint32_t TaskGraph::enqueueNDRange(Kernel &kernel, Arguments &arguments, BufferList reads, BufferList writes,
+                                   NDRange globalSize, NDRange localSize) {
+    Kernel *kernelPtr = &kernel;
+    Arguments *argumentsPtr = &arguments;
+    Node node;
+    node.command = [=](CommandBuffer &commandBuffer) {
+        commandBuffer.enqueueNDRange(*kernelPtr, *argumentsPtr, globalSize, localSize);
+    };
+    node.reads = toHandles(reads);
+    node.writes = toHandles(writes);
+    node.stage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    node.readAccess = VK_ACCESS_SHADER_READ_BIT;
+    node.writeAccess = VK_ACCESS_SHADER_WRITE_BIT;
+    return add(node);
+}
+
+uint32_t TaskGraph::copy(Buffer &src, Buffer &dst, size_t byteSize) {
+    Buffer *srcBuffer = &src, *dstBuffer = &dst;
+    Node node;
+    node.command = [=](CommandBuffer &commandBuffer) {
+        srcBuffer->enqueueCopy(*srcBuffer, *dstBuffer, byteSize, commandBuffer);
+    };
+    node.reads.push_back(src);
+    node.writes.push_back(dst);
+    node.stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    node.readAccess = VK_ACCESS_TRANSFER_READ_BIT;
+    node.writeAccess = VK_ACCESS_TRANSFER_WRITE_BIT;
+    return add(node);
+}
+
+uint32_t TaskGraph::getLevels() {
+    return levels;
+}
+
+void TaskGraph::record(CommandBuffer &commandBuffer) {
+    // Writes recorded, by buffer, and the accesses they have been made
+    // visible to since. A barrier only makes a write visible to the access
+    // types of the level after it, so later levels accessing the buffer in
+    // other ways need barriers of their own.
+    struct Written {
+        VkAccessFlags writeAccess = 0;
+        VkAccessFlags visible = 0;
+    };
+    std::map<VkBuffer, Written> written;
+    VkPipelineStageFlags recordedStages = 0;
+    for (uint32_t level = 0; level < levels; level++) {
+        VkPipelineStageFlags stages = 0;
+        std::map<VkBuffer, VkAccessFlags> accesses;
+        for (Node &node : nodes) {
+            if (node.level != level) continue;
+            stages |= node.stage;
+            for (VkBuffer buffer : node.reads) accesses[buffer] |= node.readAccess;
+            for (VkBuffer buffer : node.writes) accesses[buffer] |= node.writeAccess;
+        }
+
+        // Every node of the level depends on a node of the previous levels.
+        // The execution dependency covers write-after-read hazards; only the
+        // buffers written before need a memory dependency.
+        if (level > 0) {
+            std::vector<VkBufferMemoryBarrier> bufferMemoryBarriers;
+            for (auto &access : accesses) {
+                auto write = written.find(access.first);
+                if (write == written.end()) continue;
+                VkAccessFlags missing = access.second & ~write->second.visible;
+                if (missing == 0) continue;
+                bufferMemoryBarriers.push_back(bufferMemoryBarrier(write->first, write->second.writeAccess, missing));
+                write->second.visible |= missing;
+            }
+            commandBuffer.barrier(recordedStages, stages, bufferMemoryBarriers);
+        }
+        for (Node &node : nodes) {
+            if (node.level != level) continue;
+            node.command(commandBuffer);
+            for (VkBuffer buffer : node.writes) {
+                written[buffer].writeAccess |= node.writeAccess;
+                written[buffer].visible = 0;
+            }
+        }
+        recordedStages |= stages;
+    }
+
+    // order the graph before the commands that follow it
+    if (!nodes.empty()) {
+        std::vector<VkBufferMemoryBarrier> bufferMemoryBarriers;
+        for (auto &write : written) {
+            bufferMemoryBarriers.push_back(bufferMemoryBarrier(
+                write.first, write.second.writeAccess, VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT));
+        }
+        commandBuffer.barrier(recordedStages, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, bufferMemoryBarriers);
+    }
+}
+
+Event TaskGraph::submit() {
+    // the command buffer cannot be recorded while a submission is pending
+    done.wait();
+    if (_verbose) {
+        std::cout << "[vkrtl] task graph: " << nodes.size() << " nodes in " << levels << " levels" << std::endl;
+    }
+    commandBuffer->begin();
+    record(*commandBuffer);
+    commandBuffer->end();
+    done = Device::submit(*commandBuffer);
+    return done;
+}
+
+void TaskGraph::clear() {
+    nodes.clear();
+    hazards.clear();
+    levels = 0;
+}
+
+void TaskGraph::destroy() {
+    done.wait();
+    commandBuffer->destroy();
+    delete commandBuffer;
+    clear();
+}
+
 } // end namespace vkrtl
@@ -12,6 +12,15 @@
 // AUTHOR
 //    Marcio Machado Pereira
 
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
 #include <vulkan/vulkan.h>
 
@@ -30,19 +39,52 @@ enum Error {
     VKRTL_ERROR_COMMAND_BUFFER,
     VKRTL_ERROR_CREATE_BUFFER,
     VKRTL_ERROR_MAP,
-    VKRTL_ERROR_MALLOC
+    VKRTL_ERROR_MALLOC,
+    VKRTL_ERROR_NDRANGE
 };
 
 // Specifies a storage buffer descriptor as the Resource Type.
 enum ResourceType { STORAGE_BUFFER = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER };
 
+// How the buffers of a kernel are bound: with the descriptor sets of
+// Arguments, or pushed into the command buffer (VK_KHR_push_descriptor).
+enum BindingMode { DESCRIPTOR_SETS, PUSH_DESCRIPTORS };
+
 enum ModeOptions { VKRTL_none, VKRTL_verbose, VKRTL_profile, VKRTL_all };
 
+// Number of work items in each dimension of an OpenCL-style launch.
+struct NDRange {
+    uint32_t x, y, z;
+    NDRange(uint32_t x = 0, uint32_t y = 1, uint32_t z = 1) : x(x), y(y), z(z) {}
+};
+
 class Kernel;
 class Program;
 class Arguments;
 class CommandBuffer;
+class DescriptorAllocator;
+class DescriptorCache;
 class Device;
+class MemoryAllocator;
+class StagingRing;
+class Buffer;
+class Queue;
+class Scheduler;
+class Profiler;
+
+// Kinds of barriers between the commands recorded before and after them:
+// the writes of the first ones are made visible to the accesses of the others.
+enum BarrierType { COMPUTE_TO_COMPUTE, COMPUTE_TO_TRANSFER, TRANSFER_TO_COMPUTE, COMPUTE_TO_HOST };
+
+// A range of a buffer, by default the whole of it.
+struct BufferRange {
+    VkBuffer buffer;
+    VkDeviceSize offset, size;
+    BufferRange(Buffer &buffer, VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE);
+};
+
+// Buffers passed by reference, e.g. Arguments(kernel, {bufferA, bufferB}).
+typedef std::vector<std::reference_wrapper<Buffer>> BufferList;
 
 /*
  * The Object class is responsible for the creation and destruction
@@ -54,61 +96,671 @@ class Object {
     VkInstance instance;
 
     // The logical devices basically allows us to interact
-    // with physical devices.
+    // with physical devices. They are created on first use, with their
+    // queues, pools and staging ring, so that the physical devices the
+    // process never uses cost nothing but their enumeration.
+    std::vector<VkPhysicalDevice> physicalDevices;
+    std::vector<Device *> created;
     std::vector<Device> devices;
 
+    // index of the device returned by getDevice(), -1 until selected
+    int selected = -1;
+
+    // extensions a device must support to be selected, enabled on the devices
+    std::vector<std::string> requiredExtensions;
+
     // Debug report callbacks give more detailed feedback
     // on the application’s use of Vulkan when events occur.
     VkDebugReportCallbackEXT debugReportCallback;
 
+    double score(VkPhysicalDevice physicalDevice);
+    int find(const char *key);
+    Device &create(int index);
+
   public:
-    Object(enum ModeOptions mode = VKRTL_none);
+    Object(enum ModeOptions mode = VKRTL_none,
+           std::vector<std::string> requiredExtensions = std::vector<std::string>());
     ~Object();
+
+    // creates the logical devices of all the physical devices
     std::vector<Device> &getDevices();
+
+    // The device best suited to compute: by device type (discrete, then
+    // integrated, virtual and CPU), then size of its device-local memory,
+    // number of compute queues and subgroup size, among the devices with
+    // the required extensions. The VKRTL_DEVICE environment variable, a
+    // name, UUID or index as for getDevice(key), overrides the choice.
     Device &getDevice();
+
+    // the device whose name contains key, or whose UUID (hexadecimal,
+    // dashes ignored) or index is key
+    Device &getDevice(const char *key);
     VkInstance &getInstance();
 };
 
+/*
+ * Statistics of the device memory allocator. A block is one large
+ * VkDeviceMemory allocation from which the buffers are sub-allocated.
+ */
+struct MemoryStats {
+    // number of VkDeviceMemory blocks and of buffers bound inside them
+    uint32_t blockCount;
+    uint32_t allocationCount;
+
+    // bytes reserved from the driver, and how many of them are in use
+    VkDeviceSize blockBytes;
+    VkDeviceSize usedBytes;
+
+    // number of free ranges in all blocks and the largest of them
+    uint32_t freeRangeCount;
+    VkDeviceSize largestFreeRange;
+
+    // 0 when the free space of each block is contiguous, close to 1 when
+    // it is scattered in many small ranges (1 - largest free / total free).
+    float fragmentation;
+};
+
+/*
+ * A range of device memory handed out by the MemoryAllocator.
+ */
+struct Allocation {
+    VkDeviceMemory memory;
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    uint32_t memoryType;
+
+    // host address of the range when the memory type is host visible
+    void *mapped;
+};
+
+/*
+ * The MemoryAllocator owns large VkDeviceMemory blocks per memory type and
+ * sub-allocates them at aligned offsets. Freed ranges go back to a per-block
+ * free list and are coalesced with their neighbours, so a process creating
+ * thousands of buffers only makes a handful of vkAllocateMemory calls and
+ * stays far below maxMemoryAllocationCount.
+ */
+class MemoryAllocator {
+  private:
+    struct Block {
+        VkDeviceMemory memory;
+        VkDeviceSize size;
+        VkDeviceSize used;
+        uint32_t memoryType;
+        uint32_t allocationCount;
+        void *mapped;
+
+        // free ranges of the block, offset -> size
+        std::map<VkDeviceSize, VkDeviceSize> freeRanges;
+    };
+
+    VkDevice device;
+    VkPhysicalDeviceMemoryProperties memoryProperties;
+    VkDeviceSize nonCoherentAtomSize;
+
+    // default size of a block, reduced for small heaps. Requests
+    // larger than half a block get a block of their own.
+    VkDeviceSize blockSize;
+
+    std::vector<Block *> blocks;
+    std::mutex mutex;
+
+    Block *createBlock(uint32_t memoryType, VkDeviceSize size);
+    Block *findBlock(VkDeviceMemory memory);
+    VkDeviceSize getBlockSize(uint32_t memoryType);
+    bool isCoherent(uint32_t memoryType);
+
+  public:
+    MemoryAllocator(VkDevice device, VkPhysicalDeviceProperties &physicalDeviceProperties,
+                    VkPhysicalDeviceMemoryProperties &physicalDeviceMemoryProperties,
+                    VkDeviceSize blockSize = 64 * 1024 * 1024);
+    Allocation allocate(VkMemoryRequirements &memoryRequirements, uint32_t memoryType);
+    void free(Allocation &allocation);
+
+    // make host writes visible to the device, and device writes
+    // visible to the host, for memory types that are not coherent.
+    // The range is relative to the start of the allocation.
+    void flush(Allocation &allocation, VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE);
+    void invalidate(Allocation &allocation, VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE);
+
+    MemoryStats getStats();
+    void destroy();
+};
+
+/*
+ * A semaphore waited for or signaled by a batch. The value is only used
+ * for timeline semaphores, the stage mask only for waits.
+ */
+struct SemaphoreOperation {
+    VkSemaphore semaphore;
+    uint64_t value;
+    VkPipelineStageFlags stageMask;
+};
+
+/*
+ * A Queue wraps a VkQueue and numbers the batches submitted to it. Each
+ * batch signals either a timeline semaphore, when the device supports
+ * VK_KHR_timeline_semaphore, or a fence taken from a pool. Fences go back
+ * to the pool once they have signaled, so submission creates no Vulkan
+ * object in steady state, and waiting for a batch never idles the queue.
+ */
+class Queue {
+  private:
+    struct Submission {
+        uint64_t serial;
+        VkFence fence;
+    };
+
+    VkDevice device;
+    VkQueue queue;
+    uint32_t family;
+
+    // timeline semaphore signaled with the serial of each batch
+    VkSemaphore semaphore = VK_NULL_HANDLE;
+    PFN_vkWaitSemaphoresKHR vkWaitSemaphoresKHR = nullptr;
+    PFN_vkGetSemaphoreCounterValueKHR vkGetSemaphoreCounterValueKHR = nullptr;
+
+    // serial of the last batch submitted, and of the last one
+    // known to have completed together with all batches before it
+    uint64_t submitted = 0;
+    uint64_t completed = 0;
+
+    // batches in flight and their fences, when no timeline semaphore is used
+    std::deque<Submission> pending;
+    std::vector<VkFence> freeFences;
+
+    // number of threads waiting on each fence with the mutex released;
+    // such a fence only goes back to the pool once the last of them wakes
+    std::map<VkFence, uint32_t> waiters;
+    std::mutex mutex;
+
+    void update();
+
+  public:
+    Queue(VkDevice device, uint32_t family, uint32_t index, bool timelineSemaphore);
+
+    // Submit a batch and return its serial. The batch may wait for and
+    // signal other semaphores, at most 4 of each.
+    uint64_t submit(VkCommandBuffer commandBuffer, uint32_t waitCount = 0,
+                    const SemaphoreOperation *waits = nullptr, uint32_t signalCount = 0,
+                    const SemaphoreOperation *signals = nullptr);
+    bool isComplete(uint64_t serial);
+    void wait(uint64_t serial);
+    void wait();
+    uint32_t getFamily();
+
+    // number of batches in flight
+    uint64_t getLoad();
+
+    // the timeline semaphore signaled with the serial of each
+    // batch, or VK_NULL_HANDLE when fences are used instead
+    VkSemaphore getSemaphore();
+    void destroy();
+};
+
+/*
+ * The QueueScheduler spreads the submissions over all the queues of the
+ * compute family. A thread submits to the queue it is bound to, so that its
+ * commands keep executing in submission order, while different threads run
+ * concurrently on different queues. A thread is (re)bound to the least
+ * loaded queue whenever its queue has nothing in flight, ties being broken
+ * round-robin.
+ */
+class QueueScheduler {
+  private:
+    std::vector<Queue *> queues;
+    std::map<std::thread::id, Queue *> bindings;
+    uint32_t next = 0;
+    std::mutex mutex;
+
+  public:
+    QueueScheduler(VkDevice device, uint32_t family, uint32_t queueCount, bool timelineSemaphore);
+
+    // the queue the calling thread submits to
+    Queue *select();
+    std::vector<Queue *> &getQueues();
+
+    // wait for everything submitted to any of the queues
+    void wait();
+    void destroy();
+};
+
+/*
+ * The CommandPools hand out command buffers from one command pool per
+ * thread and queue family, so that threads record in parallel without
+ * sharing a pool (pools are externally synchronised in Vulkan). Released
+ * command buffers are kept for reuse, and once no command buffer of a pool
+ * is in use any more, the whole pool is recycled with one vkResetCommandPool.
+ * The pools of a thread are destroyed when it exits, or for those still
+ * holding command buffers, when the last of them is released.
+ */
+class CommandPools {
+  private:
+    struct Pool {
+        VkCommandPool pool;
+        std::vector<VkCommandBuffer> free;
+        uint32_t live = 0;
+
+        // the thread of the pool has exited
+        bool orphaned = false;
+    };
+
+    VkDevice device;
+    std::map<std::pair<std::thread::id, uint32_t>, Pool *> pools;
+    std::map<VkCommandPool, Pool *> byHandle;
+    std::mutex mutex;
+
+    void destroyPool(Pool *pool);
+
+  public:
+    CommandPools(VkDevice device);
+
+    // a command buffer of the pool of the calling thread for family
+    VkCommandBuffer acquire(uint32_t family, VkCommandPool &pool);
+    void release(VkCommandPool pool, VkCommandBuffer commandBuffer);
+
+    // drop the pools of a thread that is exiting
+    void threadExit(std::thread::id thread);
+    void destroy();
+};
+
+/*
+ * The DescriptorAllocator hands out the descriptor sets of all the Arguments
+ * of a device. Pools are created in chunks of setsPerPool sets, sized for
+ * the storage and uniform buffers of kernels, and a new one is added when
+ * the last one is exhausted. A set given back goes to the free list of its
+ * layout, and is handed out again to the next set of that layout without
+ * any pool call; once none of the sets of a pool is in use, the pool is
+ * reset, so that the sets of destroyed kernels do not pile up. Transient
+ * sets, only used during one epoch (e.g. a frame or a request), come from
+ * pools of their own, all of which are recycled at once with
+ * vkResetDescriptorPool by nextEpoch().
+ */
+class DescriptorAllocator {
+  private:
+    struct Pools {
+        std::vector<VkDescriptorPool> pools;
+        size_t current = 0;
+    };
+
+    VkDevice device;
+    uint32_t setsPerPool;
+    Pools persistent;
+    Pools transient;
+    std::map<VkDescriptorSetLayout, std::vector<VkDescriptorSet>> freeSets;
+
+    // the pool and layout of each persistent set, in use or free; the sets
+    // still in use of a forgotten layout are not put back on a free list
+    struct PersistentSet {
+        VkDescriptorPool pool;
+        VkDescriptorSetLayout layout;
+        bool forgotten;
+    };
+    std::map<VkDescriptorSet, PersistentSet> persistentSets;
+
+    // number of sets in use per persistent pool
+    std::map<VkDescriptorPool, uint32_t> liveSets;
+    std::mutex mutex;
+
+    VkDescriptorSet allocate(Pools &pools, VkDescriptorSetLayout layout);
+    void recycle(VkDescriptorPool descriptorPool);
+
+  public:
+    DescriptorAllocator(VkDevice device, uint32_t setsPerPool = 256) : device(device), setsPerPool(setsPerPool) {}
+
+    // a set of layout, recycled from its free list when possible
+    VkDescriptorSet allocate(VkDescriptorSetLayout layout);
+
+    // give back a set, once the commands using it have completed
+    void free(VkDescriptorSetLayout layout, VkDescriptorSet descriptorSet);
+
+    // forget the sets of a layout about to be destroyed
+    void forget(VkDescriptorSetLayout layout);
+
+    // a set valid until the next epoch
+    VkDescriptorSet allocateTransient(VkDescriptorSetLayout layout);
+
+    // Start a new epoch: all the transient sets are released, so the
+    // commands using them must have completed.
+    void nextEpoch();
+    void destroy();
+};
+
+/*
+ * The DescriptorCache keeps the descriptor sets already written, keyed by
+ * their layout and the buffer ranges bound in them, so that Arguments built
+ * again for the same kernel and buffers share a set without allocating or
+ * updating anything. Sets no Arguments uses any more stay cached up to
+ * capacity, and the least recently used ones go back to the allocator.
+ * Destroying a buffer drops the sets it is bound in.
+ */
+class DescriptorCache {
+  private:
+    struct Entry {
+        std::string key;
+        VkDescriptorSetLayout layout;
+        VkDescriptorSet descriptorSet;
+        std::vector<VkBuffer> buffers;
+
+        // number of Arguments using the set, and whether it can still be
+        // found by its key, false once one of its buffers is destroyed
+        uint32_t users;
+        bool cached;
+    };
+
+    DescriptorAllocator *allocator;
+    size_t capacity;
+
+    // most recently used first
+    std::list<Entry> entries;
+    std::map<std::string, std::list<Entry>::iterator> byKey;
+    std::map<VkDescriptorSet, std::list<Entry>::iterator> bySet;
+    std::mutex mutex;
+
+    void erase(std::list<Entry>::iterator entry);
+    void uncache(std::list<Entry>::iterator entry);
+    void evict();
+
+  public:
+    DescriptorCache(DescriptorAllocator *allocator, size_t capacity = 1024)
+        : allocator(allocator), capacity(capacity) {}
+
+    // The set of layout bound to bufferInfos, taken from the cache or
+    // allocated and filled by write. The caller uses it until release().
+    VkDescriptorSet acquire(VkDescriptorSetLayout layout, const std::vector<VkDescriptorBufferInfo> &bufferInfos,
+                            std::function<void(VkDescriptorSet)> write);
+    void release(VkDescriptorSet descriptorSet);
+
+    // drop the sets in which buffer, about to be destroyed, is bound
+    void invalidate(VkBuffer buffer);
+
+    // drop the sets of a layout about to be destroyed
+    void forget(VkDescriptorSetLayout layout);
+    void destroy();
+};
+
+/*
+ * An Event is the completion handle of a submission or of an asynchronous
+ * transfer. It is a plain value: copying it is cheap, and a default
+ * constructed Event is already complete.
+ */
+class Event {
+  private:
+    // queue and serial of the (last) batch
+    Queue *queue = nullptr;
+    uint64_t serial = 0;
+
+    // set for transfers, which are retired by the staging ring
+    // in the order of their sequence number
+    StagingRing *ring = nullptr;
+    uint64_t sequence = 0;
+
+    friend class Device;
+
+  public:
+    Event() {}
+    Event(Queue *queue, uint64_t serial, StagingRing *ring = nullptr, uint64_t sequence = 0)
+        : queue(queue), serial(serial), ring(ring), sequence(sequence) {}
+
+    // true once the work has completed on the device and, for
+    // downloads, the data has been copied to the host pointer
+    bool poll();
+
+    // block until the work completes
+    void wait();
+};
+
+/*
+ * Device time spent in the commands recorded under one name: the entry
+ * point of a kernel for its dispatches, "copy" and "barrier" otherwise.
+ */
+struct KernelProfile {
+    uint64_t count;
+    double totalMs;
+    double minMs;
+    double maxMs;
+};
+
+/*
+ * In VKRTL_profile mode the Profiler brackets every dispatch, copy and
+ * barrier with vkCmdWriteTimestamp queries. The queries of a command buffer
+ * are tied to each of its submissions, and read back once the submission
+ * has completed, so the recorded times are device times only, without the
+ * host overhead of submit and wait. A command buffer replayed while a
+ * previous submission of it is still in flight overwrites the queries of
+ * that submission, which is then only counted once.
+ *
+ * The Profiler also keeps a trace of host spans (buffer creation, program
+ * load, pipeline creation, descriptor updates, submit and wait) per thread
+ * and of device spans per queue, which exportTrace writes as Chrome
+ * trace-event JSON, to be opened in chrome://tracing or Perfetto. Device
+ * timestamps are placed on the host timeline with the offset that keeps
+ * every submission from starting before the host submitted it.
+ */
+class Profiler {
+  public:
+    struct Query {
+        VkQueryPool pool;
+        uint32_t index;
+    };
+
+  private:
+    struct Record {
+        std::string name;
+        Query query;
+    };
+    struct Pending {
+        VkCommandBuffer commandBuffer;
+        Queue *queue;
+        uint64_t serial;
+        std::vector<Record> records;
+
+        // host time of the submission, in microseconds
+        double submitted;
+    };
+
+    // A complete event of the trace. Host spans are in microseconds since
+    // origin, device spans in microseconds of the device clock.
+    struct Span {
+        std::string name;
+        bool onDevice;
+        uint32_t track;
+        double start;
+        double duration;
+    };
+
+    VkDevice device;
+
+    // nanoseconds per tick, and the bits of a timestamp that are valid
+    double timestampPeriod;
+    uint64_t timestampMask;
+
+    // queries are handed out in pairs from pools of poolSize queries
+    std::vector<VkQueryPool> pools;
+    std::vector<Query> freeQueries;
+    static const uint32_t poolSize = 256;
+
+    // name of the kernel bound to, and records of, each command buffer
+    std::map<VkCommandBuffer, std::string> bound;
+    std::map<VkCommandBuffer, std::vector<Record>> recorded;
+
+    std::deque<Pending> pending;
+    std::map<std::string, KernelProfile> profiles;
+
+    // trace, with one track per host thread and one per queue. It keeps
+    // the first maxSpans spans only, and counts the ones dropped after.
+    std::vector<Span> trace;
+    static const size_t maxSpans = 1 << 20;
+    uint64_t droppedSpans = 0;
+    std::map<std::thread::id, uint32_t> threads;
+    std::map<Queue *, uint32_t> queueTracks;
+    std::chrono::steady_clock::time_point origin;
+
+    // device clock to host timeline, in microseconds
+    double deviceOffset = 0.0;
+    bool calibrated = false;
+
+    std::mutex mutex;
+
+    void collect(bool block);
+    void addSpan(const Span &span);
+    double sinceOrigin(std::chrono::steady_clock::time_point time);
+
+  public:
+    Profiler(VkDevice device, float timestampPeriod, uint32_t timestampValidBits);
+
+    // the kernel whose dispatches are recorded next in commandBuffer
+    void bind(VkCommandBuffer commandBuffer, const std::string &name);
+    std::string getBound(VkCommandBuffer commandBuffer);
+
+    // bracket one command; end takes the query returned by begin
+    Query begin(VkCommandBuffer commandBuffer);
+    void end(VkCommandBuffer commandBuffer, Query query, const std::string &name);
+
+    // forget the records of a command buffer about to be re-recorded or freed
+    void reset(VkCommandBuffer commandBuffer);
+
+    // tie the records of a command buffer to one of its submissions
+    void submitted(VkCommandBuffer commandBuffer, Queue *queue, uint64_t serial);
+
+    // a span of host work on the calling thread
+    void hostSpan(const char *name, std::chrono::steady_clock::time_point start,
+                  std::chrono::steady_clock::time_point end);
+
+    // device times of the completed submissions, keyed by name
+    std::map<std::string, KernelProfile> getProfiles();
+
+    // write the trace of the completed submissions, false if the file
+    // cannot be written; the spans written are removed from the trace
+    bool exportTrace(const char *fileName);
+    void summary();
+    void destroy();
+};
+
 /*
  * Device objects represent logical connections to physical devices.
  * Each device exposes a number of queue families each having one or
  * more queues. All queues in a queue family support the same operations.
  */
 class Device {
+  public:
+    // The state of the device used by the objects created from it. The
+    // device, its copies and its handles (buffers, programs, kernels and
+    // arguments) share it through a pointer instead of copying it.
+    struct Context {
+        // The properties of the physical device, over a kilobyte.
+        VkPhysicalDeviceProperties physicalDeviceProperties;
+        VkPhysicalDeviceMemoryProperties physicalDeviceMemoryProperties;
+
+        // Then we have the logical device VkDevice, which basically allows
+        // us to interact with the physical device.
+        VkDevice device;
+
+        // Descriptor sets of the Arguments, pooled and recycled per layout,
+        // and shared by the Arguments binding the same buffers.
+        DescriptorAllocator *descriptors = nullptr;
+        DescriptorCache *descriptorCache = nullptr;
+
+        // Device memory of all buffers is sub-allocated from blocks owned by the allocator.
+        MemoryAllocator *allocator = nullptr;
+
+        // Host <-> device copies go through a persistently mapped staging ring.
+        StagingRing *stagingRing = nullptr;
+
+        // Timestamps of the recorded commands, only in VKRTL_profile mode.
+        Profiler *profiler = nullptr;
+
+        // Compiled pipelines, loaded from disk when the device is created and
+        // written back when it is destroyed, so that a restarted process does
+        // not compile its kernels again.
+        VkPipelineCache pipelineCache = VK_NULL_HANDLE;
+
+        // index of mappable memory type
+        int memoryTypeMappable = -1;
+
+        // index of local memory type
+        int memoryTypeLocal = -1;
+
+        // vkCmdDispatchBase, on Vulkan 1.1 devices only
+        PFN_vkCmdDispatchBaseKHR vkCmdDispatchBase = nullptr;
+
+        // vkCmdPushDescriptorSetKHR, when VK_KHR_push_descriptor is supported
+        PFN_vkCmdPushDescriptorSetKHR vkCmdPushDescriptorSet = nullptr;
+
+        // descriptor update templates, on Vulkan 1.1 devices only
+        PFN_vkCreateDescriptorUpdateTemplateKHR vkCreateDescriptorUpdateTemplate = nullptr;
+        PFN_vkDestroyDescriptorUpdateTemplateKHR vkDestroyDescriptorUpdateTemplate = nullptr;
+        PFN_vkUpdateDescriptorSetWithTemplateKHR vkUpdateDescriptorSetWithTemplate = nullptr;
+
+        // set by destroy(): the handles destructed afterwards have
+        // nothing left to release
+        bool destroyed = false;
+    };
+
   protected:
     // The physical device is some device on the system that supports usage
     // of Vulkan. Often, it is simply a graphics card that supports Vulkan.
     VkPhysicalDevice physicalDevice;
-    VkPhysicalDeviceProperties physicalDeviceProperties;
-    VkPhysicalDeviceMemoryProperties physicalDeviceMemoryProperties;
-
-    // Then we have the logical device VkDevice, which basically allows
-    // us to interact with the physical device.
-    VkDevice device;
 
-    // A queue supporting compute operations.
-    VkQueue queue;
+    std::shared_ptr<Context> context;
 
-    // The command buffer is used to record commands, that will be submitted to a queue.
-    CommandBuffer *implicitCommandBuffer;
+    // All the queues of the compute family, behind a scheduler.
+    QueueScheduler *queues = nullptr;
 
-    // index of mappable memory type
-    int memoryTypeMappable = -1;
+    // A queue of a transfer-only family, used by the staging copies so that
+    // DMA overlaps with kernel execution. Only created when the device has
+    // such a family and timeline semaphores to synchronise with it.
+    Queue *transferQueue = nullptr;
 
-    // index of local memory type
-    int memoryTypeLocal = -1;
+    // Per-thread command pools of the command buffers.
+    CommandPools *commandPools = nullptr;
 
     // index of the queue family that support compute operations
     int computeQueueFamily = -1;
 
+    // index of the queue family that only supports transfer operations
+    int transferQueueFamily = -1;
+
+    std::string getPipelineCachePath();
+    void loadPipelineCache();
+    void savePipelineCache();
+
   public:
-    Device(VkPhysicalDevice physicalDevice);
+    // requiredExtensions are enabled if the device supports them
+    Device(VkPhysicalDevice physicalDevice,
+           const std::vector<std::string> &requiredExtensions = std::vector<std::string>());
     void destroy();
     void showProperties();
-    void submit(VkCommandBuffer commandBuffer);
+    Event submit(VkCommandBuffer commandBuffer);
+
+    // Submit a command buffer that consumes the result of an asynchronous
+    // transfer. The host does not wait for the transfer: on the queue of the
+    // transfer, its barrier holds the kernel back; on another queue, the
+    // kernel waits for the timeline semaphore of the transfer queue.
+    Event submit(VkCommandBuffer commandBuffer, Event &after);
+
+    // wait for everything submitted so far, downloads included, or for one
+    // submission only
     void wait();
+    void wait(Event &event);
+
+    // release the descriptor sets of all the transient Arguments at once;
+    // the commands using them must have completed
+    void nextEpoch();
     const char *getName();
     uint32_t getVendorId();
+    MemoryStats getMemoryStats();
+
+    // per-kernel device time, empty unless profiling (VKRTL_profile)
+    std::map<std::string, KernelProfile> getKernelProfiles();
+
+    // write the host and device timeline since the previous export as
+    // Chrome trace-event JSON, false unless profiling or if the file
+    // cannot be written
+    bool exportTrace(const char *fileName);
+
+    // the context shared by the handles created from the device
+    const std::shared_ptr<Context> &getContext();
 };
 
 /*
@@ -121,19 +773,52 @@ class CommandBuffer : protected Device {
     // that will be submitted to a queue.
     VkCommandBuffer commandBuffer;
 
-    // To allocate such command buffers, we use a command pool.
+    // To allocate such command buffers, we use a command pool: the one of
+    // the creating thread, or a pool of its own for the command buffers
+    // that any thread may record (see CommandBuffer(Device&, uint32_t)).
     VkCommandPool commandPool;
+    bool ownPool = false;
 
-    void sharedConstructor();
+    void sharedConstructor(uint32_t queueFamily, bool ownPool);
 
   public:
+    // These command buffers come from the pool of the calling thread: they
+    // must be recorded on that thread, but can be submitted from any.
     CommandBuffer(Device &device);
     CommandBuffer(Device &device, Kernel &kernel, Arguments &arguments);
+
+    // command buffer with its own pool, recorded from any thread, and for
+    // the queues of any family, e.g. transfer
+    CommandBuffer(Device &device, uint32_t queueFamily);
+
+    // Command buffers are moved, never copied, and the destructor releases
+    // the ones not destroyed yet.
+    CommandBuffer(CommandBuffer &&other);
+    CommandBuffer &operator=(CommandBuffer &&other);
+    CommandBuffer(const CommandBuffer &) = delete;
+    CommandBuffer &operator=(const CommandBuffer &) = delete;
+    ~CommandBuffer();
     void destroy();
     operator VkCommandBuffer();
-    void begin();
+    // Command buffers are recorded without ONE_TIME_SUBMIT, so they can be
+    // submitted again; SIMULTANEOUS_USE lets a submission start before the
+    // previous one of the same command buffer has completed.
+    void begin(VkCommandBufferUsageFlags flags = 0);
+
+    // Full barrier: all the commands recorded before, and their writes,
+    // complete before any command recorded after starts.
     void barrier();
 
+    // Barrier between the stages of type on the given buffer ranges only,
+    // or on all memory if there are none, e.g. a kernel writing a buffer
+    // before a kernel reading it: barrier(COMPUTE_TO_COMPUTE, {buffer}).
+    void barrier(BarrierType type, std::vector<BufferRange> ranges = std::vector<BufferRange>());
+
+    // Execution dependency from srcStage to dstStage, making the writes to
+    // the given buffer ranges available and visible to the accesses after it.
+    void barrier(VkPipelineStageFlags srcStage, VkPipelineStageFlags dstStage,
+                 const std::vector<VkBufferMemoryBarrier> &bufferMemoryBarriers);
+
     // The number of local work groups in each of the x, y, and z dimensions
     // is passed in the x, y, and z parameters, respectively. A valid compute
     // pipeline must be bound to the command buffer at the
@@ -142,6 +827,26 @@ class CommandBuffer : protected Device {
     // x * y * z local work groups begins executing the shader contained
     // in the bound pipeline.
     void dispatch(int x = 1, int y = 1, int z = 1);
+
+    // Bind kernel and arguments, and launch globalSize work items in
+    // groups of the local size of the kernel, as reflected and specialized.
+    // localSize, if given, must match it. globalSize must be a multiple of
+    // the local size in each dimension (VKRTL_ERROR_NDRANGE otherwise): pad
+    // the buffers, or guard the kernel with a size of its own, to launch
+    // other sizes. Grids with more groups than maxComputeWorkGroupCount are
+    // split in several vkCmdDispatchBase calls.
+    void enqueueNDRange(Kernel &kernel, Arguments &arguments, NDRange globalSize, NDRange localSize = NDRange());
+
+    // Bind resources to kernel for the following dispatches, without any
+    // Arguments: pushed into the command buffer with a PUSH_DESCRIPTORS
+    // kernel, or else written in a transient set (see Device::nextEpoch).
+    void pushArguments(Kernel &kernel, BufferList resources);
+
+    // set the push constants of kernel for the following dispatches
+    void pushConstants(Kernel &kernel, const void *data, uint32_t byteSize, uint32_t offset = 0);
+    template <typename T> void pushConstants(Kernel &kernel, const T &value, uint32_t offset = 0) {
+        pushConstants(kernel, &value, sizeof(T), offset);
+    }
     void end();
 };
 
@@ -151,79 +856,425 @@ class CommandBuffer : protected Device {
  * sets or via certain commands, or by directly specifying them as parameters
  * to certain commands.
  */
-class Buffer : protected Device {
+class Buffer {
   private:
-    VkDeviceMemory memory;
+    // the state of the device the buffer was created from
+    std::shared_ptr<Device::Context> context;
+
+    // range of a device memory block bound to the buffer
+    Allocation allocation;
     VkBuffer buffer;
 
+    // size requested by the user, the allocation may be larger
+    VkDeviceSize byteSize;
+
+    friend class StagingRing;
+    friend class Job;
+
   public:
     Buffer(Device &device, size_t byteSize, bool mappable = false);
-    void enqueueCopy(Buffer src, Buffer dst, size_t byteSize, VkCommandBuffer commandBuffer);
+
+    // Buffers are moved, never copied: they are passed by reference, and
+    // the destructor frees the memory of the ones not destroyed yet.
+    Buffer(Buffer &&other);
+    Buffer &operator=(Buffer &&other);
+    Buffer(const Buffer &) = delete;
+    Buffer &operator=(const Buffer &) = delete;
+    ~Buffer();
+    void enqueueCopy(Buffer &src, Buffer &dst, size_t byteSize, VkCommandBuffer commandBuffer);
     void inload(void *hostPtr);
     void offload(void *hostPtr);
+
+    // Non-blocking variants of inload and offload. The host array of
+    // offloadAsync can be reused as soon as the call returns. The one of
+    // inloadAsync is only filled by waiting on the returned Event (or
+    // polling it until it completes) or on the device: waiting on a kernel
+    // submitted after it does not, and the array must stay alive until then.
+    Event inloadAsync(void *hostPtr);
+    Event offloadAsync(void *hostPtr);
     operator VkBuffer();
+    VkDeviceSize getSize();
     void destroy();
     void unmap();
     void *map();
 };
 
+/*
+ * The StagingRing is a persistently mapped, host visible buffer owned by the
+ * device. Buffer::offload and Buffer::inload take slices of it instead of
+ * creating, mapping and destroying a staging buffer on every call. The space
+ * of a slice, and the command buffer used to record its copy, are recycled
+ * once its submission has completed, so no call ever idles the queue.
+ * Copies larger than half the ring are split in several slices, and the
+ * Event of a transfer is the one of its last slice. When the device has a
+ * transfer queue, the copies run on it and the buffers are handed over to
+ * the compute queue of the calling thread with queue family ownership
+ * transfers, the queues waiting on each other's timeline semaphore.
+ */
+class StagingRing : protected Device {
+  private:
+    struct Slice {
+        CommandBuffer *commandBuffer;
 
-class Program : protected Device {
-  protected:
-    // Shader modules are represented by VkShaderModule handles.
-    // Shader modules contain shader code and one or more entry points.
-    // Shaders are selected from a shader module by specifying an entry
-    // point as part of pipeline creation. The stages of a pipeline can
-    // use shaders that come from different modules. The shader code
-    // defining a shader module must be in the SPIR-V format.
-    VkShaderModule shaderModule;
+        // With a transfer queue, the copy is recorded in transfer, and the
+        // compute queue releases and acquires the ownership of the buffer
+        // in release and commandBuffer.
+        CommandBuffer *transfer;
+        CommandBuffer *release;
+
+        // queue and serial of the submission, and position of the slice
+        // in the order of the ring
+        Queue *queue;
+        uint64_t serial;
+        uint64_t sequence;
+
+        // bytes of the ring held by the slice, including wrap-around waste
+        VkDeviceSize bytes;
+
+        // for downloads, where the slice is copied once the fence signals
+        void *hostPtr;
+        VkDeviceSize offset;
+        VkDeviceSize size;
+    };
+
+    Buffer *ring;
+    char *mapped;
+    VkDeviceSize ringSize;
+    VkDeviceSize alignment;
+
+    // next free byte of the ring and number of bytes in flight
+    VkDeviceSize head = 0;
+    VkDeviceSize used = 0;
+    uint64_t sequence = 0;
+
+    std::deque<Slice> inFlight;
+    std::vector<Slice> freeSlices;
+    std::mutex mutex;
+
+    void retire(bool block);
+    VkDeviceSize reserve(VkDeviceSize byteSize, VkDeviceSize &bytes);
+    Slice acquireSlice();
+    void ownershipBarrier(VkCommandBuffer commandBuffer, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size,
+                          bool toCompute, bool release);
+
+  public:
+    StagingRing(Device &device, VkDeviceSize ringSize = 8 * 1024 * 1024);
+
+    // copy byteSize bytes from the host to dst. Returns as soon as the copy
+    // is submitted: the data is copied into the ring, and barriers order
+    // the transfer after the commands submitted before, and before any
+    // command submitted afterwards.
+    Event upload(VkBuffer dst, VkDeviceSize dstOffset, const void *hostPtr, VkDeviceSize byteSize);
+
+    // copy byteSize bytes from src to the host. The data reaches hostPtr when
+    // the slices are retired, which the returned Event forces on wait/poll,
+    // and Device::wait for all the transfers in flight.
+    Event download(VkBuffer src, VkDeviceSize srcOffset, void *hostPtr, VkDeviceSize byteSize);
+
+    bool isComplete(uint64_t sequence);
+    void wait(uint64_t sequence);
+
+    // retire all the slices in flight, copying the downloads to the host
+    void wait();
+    void destroy();
+};
+
+/*
+ * A Job is one unit of a streaming workload: uploads, kernels and downloads
+ * recorded in three command buffers and submitted as three batches chained
+ * by semaphores. Each job owns its staging memory, so recording job k+1 and
+ * copying its inputs never waits for the jobs still in flight. The device
+ * buffers used by a job must not be used by the other jobs in flight.
+ */
+class Job : protected Device {
+  private:
+    struct Download {
+        Buffer *staging;
+        void *hostPtr;
+        VkDeviceSize offset;
+        VkDeviceSize size;
+    };
+
+    CommandBuffer *upload;
+    CommandBuffer *compute;
+    CommandBuffer *download;
+    bool hasUploads = false;
+    bool hasDownloads = false;
+
+    // binary semaphores chaining the batches, when the queue
+    // has no timeline semaphore
+    VkSemaphore uploadDone;
+    VkSemaphore computeDone;
+
+    // host visible memory holding the uploads and downloads of the job.
+    // Buffers outgrown while recording are released when the job is reused.
+    Buffer *staging = nullptr;
+    VkDeviceSize stagingUsed = 0;
+    std::vector<Buffer *> outgrownStaging;
+    std::vector<Download> downloads;
+
+    Event done;
+    bool retired = true;
+
+    VkDeviceSize reserve(VkDeviceSize byteSize);
+    void reset();
+    void retire();
+
+    friend class Scheduler;
+
+  public:
+    Job(Device &device);
+
+    // record a copy of the host array into buffer, in the upload batch
+    void offload(Buffer &buffer, const void *hostPtr);
+
+    // record a copy of buffer into the host array, in the download batch.
+    // The host array holds the data once the job has completed.
+    void inload(Buffer &buffer, void *hostPtr);
+
+    // command buffer of the compute batch, where kernels are recorded
+    CommandBuffer &getCommandBuffer();
+
+    bool poll();
+    void wait();
+    void destroy();
+};
+
+/*
+ * The Scheduler keeps a configurable number of jobs in flight on the device
+ * queue. Batches of a job are chained with the timeline semaphore of the
+ * queue when VK_KHR_timeline_semaphore is supported, and with binary
+ * semaphores otherwise; the completion of a job is tracked by its Event.
+ * While job k computes, job k-1 downloads and the host records job k+1;
+ * the host only blocks in begin(), on the job submitted inFlight jobs ago.
+ */
+class Scheduler : protected Device {
+  private:
+    std::vector<Job *> jobs;
+    uint64_t next = 0;
+
+  public:
+    Scheduler(Device &device, uint32_t inFlight = 2);
+
+    // start recording the next job
+    Job &begin();
+    Event submit(Job &job);
+
+    // wait for all the jobs in flight
+    void wait();
+    void destroy();
+};
+
+
+/*
+ * The interface of a compute entry point, reflected from the SPIR-V of its
+ * program: the resources it uses in descriptor set 0, the size of its
+ * push-constant block, and its workgroup size.
+ */
+struct EntryPoint {
+    std::vector<VkDescriptorSetLayoutBinding> bindings;
+    uint32_t pushConstantSize;
+
+    // LocalSize execution mode or WorkgroupSize built-in, and the IDs of
+    // the specialization constants overriding each dimension (-1 if none)
+    uint32_t localSize[3];
+    int32_t localSizeSpecId[3];
+};
+
+/*
+ * A Program is a SPIR-V module and the pipelines built from it. The module
+ * is shared with the kernels of the program, so that it and their pipelines
+ * are destroyed with the last of them, whatever the order of destruction.
+ */
+class Program {
+  private:
+    struct Module {
+        std::shared_ptr<Device::Context> context;
+
+        // Shader modules are represented by VkShaderModule handles.
+        // Shader modules contain shader code and one or more entry points.
+        // Shaders are selected from a shader module by specifying an entry
+        // point as part of pipeline creation. The stages of a pipeline can
+        // use shaders that come from different modules. The shader code
+        // defining a shader module must be in the SPIR-V format.
+        VkShaderModule shaderModule = VK_NULL_HANDLE;
+
+        // The pipelines built from the module, shared by all the kernels of
+        // the program. They are keyed by entry point, interface and
+        // specialization, so each specialization is compiled once.
+        std::map<std::string, VkPipeline> pipelines;
+        std::mutex mutex;
+
+        // entry points of the module, by name
+        std::map<std::string, EntryPoint> entryPoints;
+
+        ~Module();
+    };
+    std::shared_ptr<Module> module;
+
+    void sharedConstructor(Device &device, const uint32_t *code, size_t byteSize);
+
+    friend class Kernel;
 
   public:
     Program(Device &device, const char *fileName);
     Program(Device &device, uint32_t *data);
+    Program(Device &device, const uint32_t *data, size_t byteSize);
+
+    // Programs are moved, never copied; the module goes away with the
+    // program and its kernels, or when they are all destroyed.
+    Program(Program &&other) = default;
+    Program &operator=(Program &&other) = default;
+    Program(const Program &) = delete;
+    Program &operator=(const Program &) = delete;
+
+    // reflected interface of an entry point, nullptr if there is none of that name
+    const EntryPoint *getEntryPoint(const char *name);
     void destroy();
 };
 
+/*
+ * Values of the specialization constants of a kernel, e.g. its local
+ * workgroup size, tile sizes, loop trip counts or feature toggles. The
+ * driver folds them into the pipeline as compile-time constants.
+ *
+ *     Specialization spec;
+ *     spec.set(0, 16u).set(1, 512);
+ *     Kernel kn(dev, prog, "matmul", {STORAGE_BUFFER, ...}, 0, spec);
+ */
+class Specialization {
+  private:
+    std::vector<VkSpecializationMapEntry> entries;
+    std::vector<uint8_t> data;
+    VkSpecializationInfo info;
 
-class Kernel : protected Program {
-    private:
-    void sharedConstructor(const char *kernelName, std::vector<ResourceType> resourceTypes);
+  public:
+    Specialization &set(uint32_t constantID, const void *value, size_t byteSize);
+    template <typename T> Specialization &set(uint32_t constantID, const T &value) {
+        return set(constantID, &value, sizeof(T));
+    }
+    operator const VkSpecializationInfo *();
+};
 
-  protected:
-	// The pipeline layout is used by a pipeline to access the descriptor sets
-	// It defines interface (without binding any actual data) between the shader
-    // stages used by the pipeline and the shader resources
-	// A pipeline layout can be shared among multiple pipelines as long as their
-    // interfaces match.
-    VkPipelineLayout pipelineLayout;
-
-	// The descriptor set layout describes the shader binding layout
-    // (without actually referencing descriptor)
-	// Like the pipeline layout it's pretty much a blueprint and can be used with
-    // different descriptor sets as long as their layout matches.
-    VkDescriptorSetLayout descriptorSetLayout;
+
+/*
+ * A Kernel is an entry point of a program bound to a pipeline. It holds the
+ * module of its program, and shares its layout with the Arguments created
+ * from it: the layout is destroyed with the last of them.
+ */
+class Kernel {
+  private:
+    void sharedConstructor(const char *kernelName, std::vector<VkDescriptorSetLayoutBinding> bindings,
+                           uint32_t pushConstantSize, const VkSpecializationInfo *specializationInfo,
+                           BindingMode bindingMode = DESCRIPTOR_SETS);
+    static std::vector<VkDescriptorSetLayoutBinding> toBindings(std::vector<ResourceType> &resourceTypes);
+
+    std::shared_ptr<Device::Context> context;
+    std::shared_ptr<Program::Module> module;
+
+    // The interface of the kernel, shared with the Arguments created from
+    // it instead of copying its bindings.
+    struct Layout {
+        std::shared_ptr<Device::Context> context;
+
+        // The entry point, used to name the dispatches of the kernel.
+        std::string kernelName;
+
+        // The resources of the kernel, in the order of the Arguments buffers.
+        std::vector<VkDescriptorSetLayoutBinding> bindings;
+
+        // Size of a workgroup, once specialized; 1 in the dimensions the
+        // SPIR-V does not tell.
+        uint32_t localSize[3] = {1, 1, 1};
+
+        // The set layout has the push-descriptor flag: its buffers are pushed
+        // into the command buffers, and it has no descriptor sets.
+        bool pushDescriptorLayout = false;
+
+        // Writes a set of the layout from the VkDescriptorBufferInfo of its
+        // buffers, packed in the order of the bindings, in a single call.
+        // VK_NULL_HANDLE without Vulkan 1.1 or for push-descriptor layouts.
+        VkDescriptorUpdateTemplate updateTemplate = VK_NULL_HANDLE;
+
+        // Size in bytes of the push-constant range of the kernel, 0 if none.
+        // Push constants carry small scalar arguments inside the command
+        // buffer, without any buffer, copy or descriptor update.
+        uint32_t pushConstantSize = 0;
+
+        // The pipeline layout is used by a pipeline to access the descriptor sets
+        // It defines interface (without binding any actual data) between the shader
+        // stages used by the pipeline and the shader resources
+        // A pipeline layout can be shared among multiple pipelines as long as their
+        // interfaces match.
+        VkPipelineLayout pipelineLayout = VK_NULL_HANDLE;
+
+        // The descriptor set layout describes the shader binding layout
+        // (without actually referencing descriptor)
+        // Like the pipeline layout it's pretty much a blueprint and can be used with
+        // different descriptor sets as long as their layout matches.
+        VkDescriptorSetLayout descriptorSetLayout = VK_NULL_HANDLE;
+
+        // the writes of the bindings, in order, of the buffers of bufferInfos into descriptorSet
+        void getWrites(VkDescriptorSet descriptorSet, const VkDescriptorBufferInfo *bufferInfos,
+                       std::vector<VkWriteDescriptorSet> &writes);
+        ~Layout();
+    };
+    std::shared_ptr<Layout> layout;
 
 	// Pipelines (often called "pipeline state objects") are used to bake all
     // states that affect a pipeline
 	// Vulkan requires to layout the compute (and graphics) pipeline states upfront
 	// So for each combination of non-dynamic pipeline states we need a new pipeline.
+    // It is owned by the program, which shares it with identical kernels.
     VkPipeline pipeline;
 
+    friend class Arguments;
+
   public:
+    // Kernel whose layout is reflected from the SPIR-V of the program.
+    // PUSH_DESCRIPTORS falls back to DESCRIPTOR_SETS when the device does
+    // not support it. Only storage and uniform buffers can be bound: an
+    // entry point using images, samplers or texel buffers is rejected.
+    Kernel(Device &device, Program &program, const char *kernelName,
+           const VkSpecializationInfo *specializationInfo = nullptr, BindingMode bindingMode = DESCRIPTOR_SETS);
     Kernel(Device &device, Program &program, const char *kernelName,
-           std::vector<ResourceType> resourceTypes);
+           std::vector<ResourceType> resourceTypes, uint32_t pushConstantSize = 0,
+           const VkSpecializationInfo *specializationInfo = nullptr, BindingMode bindingMode = DESCRIPTOR_SETS);
     Kernel(Device &device, Program &program, const char *kernelName,
-           VkCommandBuffer commandBuffer, std::vector<ResourceType> resourceTypes);
+           VkCommandBuffer commandBuffer, std::vector<ResourceType> resourceTypes,
+           uint32_t pushConstantSize = 0, const VkSpecializationInfo *specializationInfo = nullptr);
+
+    // Kernels are moved, never copied, like programs.
+    Kernel(Kernel &&other) = default;
+    Kernel &operator=(Kernel &&other) = default;
+    Kernel(const Kernel &) = delete;
+    Kernel &operator=(const Kernel &) = delete;
     void bindTo(VkCommandBuffer commandBuffer);
+
+    // Record the update of byteSize bytes of the push constants at offset,
+    // which the dispatches recorded afterwards read.
+    void pushConstants(VkCommandBuffer commandBuffer, const void *data, uint32_t byteSize, uint32_t offset = 0);
+
+    // Record the binding of resources for the dispatches recorded afterwards
+    // (see CommandBuffer::pushArguments).
+    void pushArguments(VkCommandBuffer commandBuffer, BufferList &resources);
+    BindingMode getBindingMode();
+
+    const uint32_t *getLocalSize();
+
+    // number of workgroups covering exactly (rounding up) a grid of
+    // globalX * globalY * globalZ invocations
+    void getGroupCount(uint32_t globalX, uint32_t globalY, uint32_t globalZ, uint32_t groupCount[3]);
     void destroy();
 };
 
 
-class Arguments : protected Kernel {
+class Arguments {
   private:
-    // Descriptors represent resources in shaders. They allow us
-    // to use things like uniform buffers, storage buffers, etc.
-    VkDescriptorPool descriptorPool;
+    std::shared_ptr<Device::Context> context;
+
+    // the interface of the kernel the arguments are bound to
+    std::shared_ptr<Kernel::Layout> layout;
 
 	// The descriptor set stores the resources bound to the binding
     // points in a shader. It connects the binding points of the
@@ -231,14 +1282,160 @@ class Arguments : protected Kernel {
     // A single descriptor represents a single resource, and
     // several descriptors are organized into descriptor sets,
     // which are basically just collections of descriptors.
+    // The set comes from the descriptor cache of the device, or from its
+    // descriptor allocator for transient arguments.
     VkDescriptorSet descriptorSet;
 
-    void sharedConstructor(std::vector<Buffer> resources);
+    // transient sets are released by Device::nextEpoch, not by destroy
+    bool transient;
+
+    // the set is the arguments' own, not shared through the cache,
+    // since it has been rebound
+    bool owned = false;
+
+    void write(VkDescriptorSet descriptorSet, const VkDescriptorBufferInfo *bufferInfos);
+
+    void sharedConstructor(BufferList &resources);
 
   public:
-    Arguments(Kernel &kernel, std::vector<Buffer> resources);
-    Arguments(Kernel &kernel, VkCommandBuffer commandBuffer, std::vector<Buffer> resources);
+    Arguments(Kernel &kernel, BufferList resources, bool transient = false);
+    Arguments(Kernel &kernel, VkCommandBuffer commandBuffer, BufferList resources, bool transient = false);
+
+    // Arguments are moved, never copied: the destructor gives back the set
+    // of the ones not destroyed yet.
+    Arguments(Arguments &&other);
+    Arguments &operator=(Arguments &&other);
+    Arguments(const Arguments &) = delete;
+    Arguments &operator=(const Arguments &) = delete;
+    ~Arguments();
     void bindTo(VkCommandBuffer commandBuffer);
+
+    // Bind other buffers to the set, given as one VkDescriptorBufferInfo per
+    // descriptor in the order of the bindings. With an update template,
+    // this is a single vkUpdateDescriptorSetWithTemplate call, with no
+    // allocation. The command buffers recorded with the previous binding
+    // must have completed, and be recorded again before they are submitted.
+    void rebind(const VkDescriptorBufferInfo *bufferInfos);
+    void destroy();
+};
+
+/*
+ * A Capture records a sequence of dispatches, copies and barriers once and
+ * replays it with a single submission each time, for iterative workloads
+ * running the same kernels on the same Arguments many times. Inputs change
+ * between replays through the contents of the buffers (e.g. offload, which
+ * is ordered before the next replay), or through push constants read from
+ * host memory: replay() records the sequence again, from the commands kept
+ * on the host, only when one of those values has changed. The kernels,
+ * arguments and buffers are kept by reference and must outlive the capture.
+ */
+class Capture : protected Device {
+  private:
+    CommandBuffer *commandBuffer;
+    std::vector<std::function<void(CommandBuffer &)>> commands;
+
+    // host memory of the push constants, and its value when recorded
+    struct Parameter {
+        const void *hostPtr;
+        std::vector<uint8_t> recorded;
+    };
+    std::vector<Parameter> parameters;
+
+    // the replays that may still be pending, on the queues of the threads
+    // that submitted them, and the lock of the threads replaying
+    std::vector<Event> replays;
+    std::mutex mutex;
+
+    void add(std::function<void(CommandBuffer &)> command);
+    void waitReplays();
+
+  public:
+    Capture(Device &device);
+
+    // start capturing a new sequence, replacing the previous one
+    void begin();
+    void dispatch(Kernel &kernel, Arguments &arguments, uint32_t x = 1, uint32_t y = 1, uint32_t z = 1);
+    void enqueueNDRange(Kernel &kernel, Arguments &arguments, NDRange globalSize, NDRange localSize = NDRange());
+    void copy(Buffer &src, Buffer &dst, size_t byteSize);
+    void barrier();
+    void barrier(BarrierType type, std::vector<BufferRange> ranges = std::vector<BufferRange>());
+
+    // push constants whose value is read from hostPtr at each replay
+    void pushConstants(Kernel &kernel, const void *hostPtr, uint32_t byteSize, uint32_t offset = 0);
+    void end();
+
+    // submit the captured sequence; replays may be submitted from any
+    // thread, the capture itself is recorded by one thread only
+    Event replay();
+    void destroy();
+};
+
+/*
+ * A TaskGraph records kernels and copies with the buffers each of them reads
+ * and writes, instead of a barrier after every command. A node depends on
+ * the nodes added before it that write a buffer it accesses, or that read a
+ * buffer it writes. Nodes are ordered in levels, each one after the deepest
+ * node it depends on: the nodes of a level are independent and are recorded
+ * back to back, so they may overlap on the device, and a single barrier
+ * separates two levels, with a VkBufferMemoryBarrier only for the buffers
+ * written before and accessed after it. The nodes of a graph are recorded
+ * in the order of their levels, not the order in which they were added.
+ * The kernels, arguments and buffers are kept by reference and must outlive
+ * the graph, which binds the sets the arguments hold each time it is recorded.
+ */
+class TaskGraph : protected Device {
+  private:
+    struct Node {
+        std::function<void(CommandBuffer &)> command;
+        std::vector<VkBuffer> reads;
+        std::vector<VkBuffer> writes;
+
+        // transfer for copies, compute shader for kernels
+        VkPipelineStageFlags stage;
+        VkAccessFlags readAccess;
+        VkAccessFlags writeAccess;
+        uint32_t level;
+    };
+    std::vector<Node> nodes;
+
+    // deepest level writing and reading each buffer since its last write
+    struct Hazards {
+        int32_t writeLevel = -1;
+        int32_t readLevel = -1;
+    };
+    std::map<VkBuffer, Hazards> hazards;
+    uint32_t levels = 0;
+
+    CommandBuffer *commandBuffer;
+
+    // completion of the last submission
+    Event done;
+
+    uint32_t add(Node node);
+
+  public:
+    TaskGraph(Device &device);
+
+    // add a kernel launch reading and writing the given buffers, which must
+    // cover all the buffers of arguments it accesses. Returns the node index.
+    uint32_t dispatch(Kernel &kernel, Arguments &arguments, BufferList reads, BufferList writes,
+                      uint32_t x = 1, uint32_t y = 1, uint32_t z = 1);
+    uint32_t enqueueNDRange(Kernel &kernel, Arguments &arguments, BufferList reads, BufferList writes,
+                            NDRange globalSize, NDRange localSize = NDRange());
+    uint32_t copy(Buffer &src, Buffer &dst, size_t byteSize);
+
+    // number of levels, i.e. of barriers plus one, of the graph
+    uint32_t getLevels();
+
+    // Record the graph into commandBuffer, followed by a barrier ordering
+    // it before the commands recorded or submitted afterwards.
+    void record(CommandBuffer &commandBuffer);
+
+    // record the graph into a command buffer of its own and submit it
+    Event submit();
+
+    // remove all the nodes, to build another graph
+    void clear();
     void destroy();
 };
 
@@ -0,0 +1,52 @@
+#include <iostream>
+#include <vector>
+#include "../src/vkrtlib.h"
+
+using namespace std;
+using namespace vkrtl;
+
+#define N 1024
+
+void printStats(Device &dev)
+{
+    MemoryStats stats = dev.getMemoryStats();
+    cout << "blocks = " << stats.blockCount << " (" << stats.blockBytes << " bytes), buffers = "
+         << stats.allocationCount << ", used = " << stats.usedBytes << " bytes, free ranges = "
+         << stats.freeRangeCount << ", fragmentation = " << stats.fragmentation << endl;
+}
+
+int main()
+{
+    // Create a Vulkan Object
+    Object obj;
+    // Get the GPU device
+    Device &dev = obj.getDevice();
+
+    // Create many small buffers. They are all sub-allocated from
+    // a few large blocks of device memory.
+    vector<Buffer> buffers;
+    for (int i = 0; i < N; i++) {
+        buffers.push_back(Buffer(dev, sizeof(float) * (i % 64 + 1), i % 2));
+    }
+    printStats(dev);
+
+    // Destroy every other buffer: the free space becomes fragmented
+    for (int i = 0; i < N; i += 2) {
+        buffers[i].destroy();
+    }
+    printStats(dev);
+
+    // A new buffer reuses one of the freed ranges
+    Buffer buffer(dev, sizeof(float) * 16);
+    printStats(dev);
+
+    // Cleanup
+    buffer.destroy();
+    for (int i = 1; i < N; i += 2) {
+        buffers[i].destroy();
+    }
+    printStats(dev);
+    dev.destroy();
+
+    return 0;
+}
@@ -0,0 +1,57 @@
+#include <iostream>
+#include "../src/vkrtlib.h"
+
+using namespace std;
+using namespace vkrtl;
+
+#define N 512
+
+int main()
+{
+    // Create a Vulkan Object
+    Object obj;
+    // Get the GPU device
+    Device &dev = obj.getDevice();
+
+    // Create a device local buffer
+    Buffer buffer(dev, sizeof(float) * N);
+
+    Program prog(dev, "../shaders/doubleMe.spv");
+    Kernel kn(dev, prog, "doubleMe", {STORAGE_BUFFER});
+    Arguments args(kn, {buffer});
+    CommandBuffer cmd(dev, kn, args);
+    cmd.dispatch(N);
+    cmd.barrier();
+    cmd.end();
+
+    // upload the input without blocking; A can be reused right away
+    float A[N];
+    for (int i = 0; i < N; i++)
+        A[i] = (float)i;
+    Event uploaded = buffer.offloadAsync(A);
+    for (int i = 0; i < N; i++)
+        A[i] = 0.0f;
+
+    // the kernel is chained to the upload, and the result
+    // is downloaded while the host keeps working
+    dev.submit(cmd, uploaded);
+    Event downloaded = buffer.inloadAsync(A);
+    int polls = 0;
+    while (!downloaded.poll())
+        polls++;
+    downloaded.wait();
+    cout << "polls before completion = " << polls << endl;
+
+    for (int i = 0; i < 15; i++)
+        cout << "A[" << i << "] = " << A[i] << endl;
+
+    // Cleanup
+    buffer.destroy();
+    cmd.destroy();
+    args.destroy();
+    kn.destroy();
+    prog.destroy();
+    dev.destroy();
+
+    return 0;
+}
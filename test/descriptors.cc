@@ -0,0 +1,85 @@
+#include <iostream>
+#include <chrono>
+#include "../src/vkrtlib.h"
+
+using namespace std;
+using namespace chrono;
+using namespace vkrtl;
+
+#define N 512
+#define BUFFERS 4
+#define REQUESTS 10000
+
+int main()
+{
+    // Create a Vulkan Object
+    Object obj;
+    // Get the GPU device
+    Device &dev = obj.getDevice();
+
+    vector<Buffer> buffers;
+    for (int i = 0; i < BUFFERS; i++)
+        buffers.push_back(Buffer(dev, sizeof(float) * N));
+
+    Program prog(dev, "../shaders/doubleMe.spv");
+    Kernel kn(dev, prog, "doubleMe", {STORAGE_BUFFER});
+
+    // Arguments built per request over the same few buffers share the
+    // descriptor sets already written
+    steady_clock::time_point start = steady_clock::now();
+    for (int k = 0; k < REQUESTS; k++) {
+        Arguments args(kn, {buffers[k % BUFFERS]});
+        args.destroy();
+    }
+    cout << REQUESTS << " cached Arguments in " << duration_cast<microseconds>(steady_clock::now() - start).count()
+         << "us" << endl;
+
+    // transient Arguments are all released at the end of their epoch
+    start = steady_clock::now();
+    for (int k = 0; k < REQUESTS; k++) {
+        Arguments args(kn, {buffers[k % BUFFERS]}, true);
+        if (k % 100 == 99)
+            dev.nextEpoch();
+    }
+    cout << REQUESTS << " transient Arguments in " << duration_cast<microseconds>(steady_clock::now() - start).count()
+         << "us" << endl;
+
+    // one set rebound to another buffer per request, in place
+    Arguments rebound(kn, {buffers[0]});
+    start = steady_clock::now();
+    for (int k = 0; k < REQUESTS; k++) {
+        VkDescriptorBufferInfo bufferInfo = {buffers[k % BUFFERS], 0, VK_WHOLE_SIZE};
+        rebound.rebind(&bufferInfo);
+    }
+    cout << REQUESTS << " rebinds in " << duration_cast<microseconds>(steady_clock::now() - start).count()
+         << "us" << endl;
+    rebound.destroy();
+
+    // with push descriptors, the buffers of each dispatch are recorded
+    // in the command buffer, without any descriptor set
+    Kernel pushKn(dev, prog, "doubleMe", {STORAGE_BUFFER}, 0, nullptr, PUSH_DESCRIPTORS);
+    cout << "push descriptors: " << (pushKn.getBindingMode() == PUSH_DESCRIPTORS ? "yes" : "no") << endl;
+    CommandBuffer cmd(dev);
+    cmd.begin();
+    pushKn.bindTo(cmd);
+    for (int i = 0; i < BUFFERS; i++) {
+        cmd.pushArguments(pushKn, {buffers[i]});
+        cmd.dispatch(N);
+    }
+    cmd.barrier();
+    cmd.end();
+    dev.submit(cmd);
+    dev.wait();
+    dev.nextEpoch();
+
+    // Cleanup
+    cmd.destroy();
+    pushKn.destroy();
+    for (int i = 0; i < BUFFERS; i++)
+        buffers[i].destroy();
+    kn.destroy();
+    prog.destroy();
+    dev.destroy();
+
+    return 0;
+}
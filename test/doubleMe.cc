@@ -11,7 +11,7 @@ using namespace vkrtl;
 int main()
 {
     // Create a Vulkan Object
-    Object obj(VKRTL_verbose);
+    Object obj(VKRTL_all);
     // Get the GPU device
     Device &device = obj.getDevice();
     // Create the shared buffer
@@ -41,6 +41,10 @@ int main()
     cout << "Compute time = " << duration_cast<milliseconds>(steady_clock::now() - start).count()
          << "ms" << endl;
 
+    // device time of the kernel alone, measured with timestamp queries
+    for (auto &profile : device.getKernelProfiles())
+        cout << "Device time of " << profile.first << " = " << profile.second.totalMs << "ms" << endl;
+
     // map the buffer to CPU and print
     float *B = (float *)buffer.map();
     for (int i = 0; i < N; i++){
@@ -0,0 +1,62 @@
+#include <iostream>
+#include <chrono>
+#include "../src/vkrtlib.h"
+
+using namespace std;
+using namespace chrono;
+using namespace vkrtl;
+
+#define N 512
+#define ITERATIONS 1000
+
+int main()
+{
+    // Create a Vulkan Object
+    Object obj;
+    // Get the GPU device
+    Device &dev = obj.getDevice();
+
+    Buffer bufferA(dev, sizeof(float) * N);
+    Buffer bufferB(dev, sizeof(float) * N);
+
+    Program prog(dev, "../shaders/doubleMe.spv");
+    Kernel kn(dev, prog, "doubleMe", {STORAGE_BUFFER});
+    Arguments args(kn, {bufferA});
+
+    // record the iteration once: double A in place, and keep a copy in B
+    Capture capture(dev);
+    capture.begin();
+    capture.dispatch(kn, args, N);
+    capture.barrier(COMPUTE_TO_TRANSFER, {bufferA});
+    capture.copy(bufferA, bufferB, sizeof(float) * N);
+    capture.barrier();
+    capture.end();
+
+    // replay it, resetting the input through the buffer contents
+    float A[N];
+    steady_clock::time_point start = steady_clock::now();
+    for (int k = 0; k < ITERATIONS; k++) {
+        for (int i = 0; i < N; i++)
+            A[i] = (float)(i + k);
+        bufferA.offload(A);
+        capture.replay();
+    }
+    dev.wait();
+    cout << ITERATIONS << " replays in " << duration_cast<milliseconds>(steady_clock::now() - start).count()
+         << "ms" << endl;
+
+    bufferB.inload(A);
+    for (int i = 0; i < 15; i++)
+        cout << "B[" << i << "] = " << A[i] << endl;
+
+    // Cleanup
+    capture.destroy();
+    bufferA.destroy();
+    bufferB.destroy();
+    args.destroy();
+    kn.destroy();
+    prog.destroy();
+    dev.destroy();
+
+    return 0;
+}
@@ -0,0 +1,69 @@
+#include <iostream>
+#include <vector>
+#include "../src/vkrtlib.h"
+
+using namespace std;
+using namespace vkrtl;
+
+#define N 512
+#define JOBS 16
+#define IN_FLIGHT 3
+
+int main()
+{
+    // Create a Vulkan Object
+    Object obj(VKRTL_profile);
+    // Get the GPU device
+    Device &dev = obj.getDevice();
+
+    Program prog(dev, "../shaders/doubleMe.spv");
+    Kernel kn(dev, prog, "doubleMe", {STORAGE_BUFFER});
+
+    // One device buffer and argument set per job in flight
+    vector<Buffer> buffers;
+    vector<Arguments> args;
+    for (int i = 0; i < IN_FLIGHT; i++) {
+        buffers.push_back(Buffer(dev, sizeof(float) * N));
+        args.push_back(Arguments(kn, {buffers[i]}));
+    }
+
+    // Host input and output of every job
+    vector<vector<float>> input(JOBS, vector<float>(N));
+    vector<vector<float>> output(JOBS, vector<float>(N));
+    for (int k = 0; k < JOBS; k++)
+        for (int i = 0; i < N; i++)
+            input[k][i] = (float)(k * N + i);
+
+    // Record job k+1 while job k computes and job k-1 downloads
+    Scheduler scheduler(dev, IN_FLIGHT);
+    for (int k = 0; k < JOBS; k++) {
+        Job &job = scheduler.begin();
+        job.offload(buffers[k % IN_FLIGHT], input[k].data());
+        CommandBuffer &cmd = job.getCommandBuffer();
+        args[k % IN_FLIGHT].bindTo(cmd);
+        kn.bindTo(cmd);
+        cmd.dispatch(N);
+        job.inload(buffers[k % IN_FLIGHT], output[k].data());
+        scheduler.submit(job);
+    }
+    scheduler.wait();
+
+    // open in chrome://tracing or ui.perfetto.dev
+    if (dev.exportTrace("stream.json"))
+        cout << "trace written to stream.json" << endl;
+
+    for (int k = 0; k < JOBS; k += 5)
+        cout << "job " << k << ": B[1] = " << output[k][1] << endl;
+
+    // Cleanup
+    scheduler.destroy();
+    for (int i = 0; i < IN_FLIGHT; i++) {
+        args[i].destroy();
+        buffers[i].destroy();
+    }
+    kn.destroy();
+    prog.destroy();
+    dev.destroy();
+
+    return 0;
+}
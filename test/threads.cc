@@ -0,0 +1,63 @@
+#include <iostream>
+#include <thread>
+#include <vector>
+#include "../src/vkrtlib.h"
+
+using namespace std;
+using namespace vkrtl;
+
+#define N 512
+#define THREADS 4
+#define ROUNDS 8
+
+int main()
+{
+    // Create a Vulkan Object
+    Object obj;
+    // Get the GPU device
+    Device &dev = obj.getDevice();
+
+    Program prog(dev, "../shaders/doubleMe.spv");
+    Kernel kn(dev, prog, "doubleMe", {STORAGE_BUFFER});
+
+    // every thread records and submits its own command buffers, from the
+    // command pool of the thread; only the submissions meet at the queue
+    vector<vector<float>> results(THREADS, vector<float>(N));
+    vector<thread> threads;
+    for (int t = 0; t < THREADS; t++) {
+        threads.push_back(thread([&, t]() {
+            Buffer buffer(dev, sizeof(float) * N);
+            Arguments args(kn, {buffer});
+            vector<float> A(N);
+            for (int i = 0; i < N; i++)
+                A[i] = (float)(t * N + i);
+            buffer.offload(A.data());
+            for (int r = 0; r < ROUNDS; r++) {
+                CommandBuffer cmd(dev, kn, args);
+                cmd.dispatch(N);
+                cmd.barrier();
+                cmd.end();
+                Event done = dev.submit(cmd);
+                dev.wait(done);
+                cmd.destroy();
+            }
+            buffer.inload(results[t].data());
+            args.destroy();
+            buffer.destroy();
+        }));
+    }
+    for (auto &worker : threads)
+        worker.join();
+
+    // each element was doubled ROUNDS times
+    for (int t = 0; t < THREADS; t++)
+        cout << "thread " << t << ": B[1] = " << results[t][1] << " (expected "
+             << (float)(t * N + 1) * (1 << ROUNDS) << ")" << endl;
+
+    // Cleanup
+    kn.destroy();
+    prog.destroy();
+    dev.destroy();
+
+    return 0;
+}
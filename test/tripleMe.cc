@@ -34,12 +34,12 @@ int main()
     Kernel kn1(dev, prog, "doubleMe", cmd, {STORAGE_BUFFER});
     Arguments args1(kn1, cmd, {buffer});
     cmd.dispatch(N);
-    cmd.barrier();
+    cmd.barrier(COMPUTE_TO_COMPUTE, {buffer});
 
     Kernel kn2(dev, prog, "tripleMe", cmd, {STORAGE_BUFFER});
     Arguments args2(kn2, cmd, {buffer});
     cmd.dispatch(N);
-    cmd.barrier();
+    cmd.barrier(COMPUTE_TO_HOST, {buffer});
 
     cmd.end(); // end recording
 
@@ -33,10 +33,16 @@ int main()
     bufferB.unmap();
 
     Program prog(dev, "../shaders/vet3sum.spv");
-    Kernel kn(dev, prog, "vet3sum", {STORAGE_BUFFER, STORAGE_BUFFER, STORAGE_BUFFER});
+    // the kernel indexes with 16 * group + local id: specialize its
+    // workgroup size (spec constant 0) to 16, and let the bindings and
+    // the group count be derived from the SPIR-V
+    Specialization spec;
+    spec.set(0, 16u);
+    Kernel kn(dev, prog, "vet3sum", spec);
     Arguments args(kn, {bufferA, bufferB, bufferC});
-    CommandBuffer cmd(dev, kn, args);
-    cmd.dispatch(32, 16, 1);
+    CommandBuffer cmd(dev);
+    cmd.begin();
+    cmd.enqueueNDRange(kn, args, NDRange(N), NDRange(16));
     cmd.barrier();
     cmd.end();
 